@@ -0,0 +1,431 @@
+/**
+ * Batch driver: runs a chain of QTree operations over many images.
+ *
+ * Usage: batch [-j threads] [-q depth] manifest [op...]
+ *   -j threads  worker threads; 0 means one per hardware thread (default 0)
+ *   -q depth    images allowed to wait between two stages (default: threads)
+ *   manifest    text file with one "input.png output.png" pair per line;
+ *               blank lines and lines starting with # are skipped
+ *   op          applied to every tree in the order given:
+ *                 prune=TOL  Prune(TOL)
+ *                 flip       FlipHorizontal()
+ *                 rotate     RotateCCW()
+ *                 scale=N    render at xN instead of x1
+ *                 thumb=N    render shrunk to fit in N x N, for images larger than that
+ *
+ * Every image goes through four stages: decode (read and decode the
+ * input), build (construct the tree), transform (apply the ops and
+ * render) and encode (encode and write the output). A fixed set of
+ * workers runs whichever stage has work, so tree work on some images
+ * overlaps with PNG I/O on others. The queue between two stages holds at
+ * most depth images, and a worker only starts a stage when there is room
+ * for its result, so the number of images in memory stays bounded
+ * whatever the length of the manifest.
+ *
+ * One JSON line is written to stdout per image as it completes, with the
+ * time spent in each stage and the latency from the start of its decode
+ * to the end of its encode, followed by aggregate throughput. Built with
+ * optimizations by `make batch`.
+ */
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "qtree.h"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+/**
+ * One step of the chain applied to every tree.
+ */
+struct BatchOp {
+	enum Kind { PRUNE, FLIP, ROTATE };
+
+	Kind kind;
+	double tolerance; // for PRUNE
+};
+
+/**
+ * What to run, as given on the command line.
+ */
+struct BatchConfig {
+	unsigned int threads;
+	unsigned int depth;
+	vector<BatchOp> ops;
+	unsigned int scale;
+	unsigned int thumb; // longest side of a downscaled render, or 0 to render at scale
+};
+
+/**
+ * The four stages every image goes through, in order.
+ */
+enum Stage { DECODE, BUILD, TRANSFORM, ENCODE, STAGES };
+
+static const char* STAGE_NAMES[STAGES] = { "decode", "build", "transform", "encode" };
+
+/**
+ * One image in flight, and what is known about it so far.
+ */
+struct BatchJob {
+	string input;
+	string output;
+
+	PNG image;             // decoded input, then rendered output
+	unique_ptr<QTree> tree;
+	unsigned int width;
+	unsigned int height;
+	unsigned int nodes;    // nodes after the ops
+	string error;          // empty unless a stage failed
+
+	Clock::time_point start;
+	double seconds[STAGES]; // time spent in each stage
+};
+
+/**
+ * Pipeline state shared by the workers. Everything in it is guarded by
+ * lock.
+ */
+class Batch {
+public:
+	Batch(const BatchConfig& config, const vector<pair<string, string>>& manifest);
+
+	/**
+	 * Processes the whole manifest on config.threads workers, reporting
+	 * each image as it completes, and returns the number that failed.
+	 */
+	unsigned int Run();
+
+	/**
+	 * Latency of every completed image, in completion order.
+	 */
+	const vector<double>& Latencies() const;
+
+	/**
+	 * Total input pixels of the images that succeeded.
+	 */
+	uint64_t Pixels() const;
+
+private:
+	const BatchConfig& config;
+	const vector<pair<string, string>>& manifest;
+
+	mutex lock;
+	condition_variable changed;
+	size_t next;                                 // next manifest entry to decode
+	deque<unique_ptr<BatchJob>> waiting[STAGES]; // waiting[s]: jobs done with stage s - 1, queued for stage s
+	unsigned int reserved[STAGES];               // jobs running stage s - 1 that will be queued for stage s
+	size_t completed;
+	unsigned int failed;
+	vector<double> latencies;
+	uint64_t pixels;
+
+	void Work();
+	bool CanStart(unsigned int stage) const;
+	void RunStage(unsigned int stage, BatchJob& job) const;
+	void Report(const BatchJob& job, double latency);
+};
+
+Batch::Batch(const BatchConfig& config, const vector<pair<string, string>>& manifest)
+	: config(config), manifest(manifest), next(0), completed(0), failed(0), pixels(0) {
+	for (unsigned int s = 0; s < STAGES; s++) {
+		reserved[s] = 0;
+	}
+}
+
+unsigned int Batch::Run() {
+	vector<thread> workers;
+	for (unsigned int i = 0; i < config.threads; i++) {
+		workers.emplace_back(&Batch::Work, this);
+	}
+	for (thread& worker : workers) {
+		worker.join();
+	}
+	return failed;
+}
+
+const vector<double>& Batch::Latencies() const {
+	return latencies;
+}
+
+uint64_t Batch::Pixels() const {
+	return pixels;
+}
+
+/**
+ * A stage may start when it has an input and, unless it is the last one,
+ * room in the queue that its result goes to. Must be called with lock
+ * held.
+ */
+bool Batch::CanStart(unsigned int stage) const {
+	bool hasInput = (stage == DECODE) ? next < manifest.size() : !waiting[stage].empty();
+	return hasInput && (stage == ENCODE || waiting[stage + 1].size() + reserved[stage + 1] < config.depth);
+}
+
+/**
+ * Worker loop. Later stages are preferred so that images leave the
+ * pipeline before new ones are decoded.
+ */
+void Batch::Work() {
+	unique_lock<mutex> guard(lock);
+	while (completed < manifest.size()) {
+		int stage = ENCODE;
+		while (stage >= 0 && !CanStart(stage)) {
+			stage--;
+		}
+		if (stage < 0) {
+			changed.wait(guard);
+			continue;
+		}
+
+		unique_ptr<BatchJob> job;
+		if (stage == DECODE) {
+			job.reset(new BatchJob());
+			job->input = manifest[next].first;
+			job->output = manifest[next].second;
+			job->width = job->height = job->nodes = 0;
+			fill(job->seconds, job->seconds + STAGES, 0.0);
+			job->start = Clock::now();
+			next++;
+		} else {
+			job = move(waiting[stage].front());
+			waiting[stage].pop_front();
+		}
+		if (stage != ENCODE) {
+			reserved[stage + 1]++;
+		}
+		// the job left a queue, so whoever was waiting for room may go on
+		changed.notify_all();
+
+		guard.unlock();
+		Clock::time_point begin = Clock::now();
+		if (job->error.empty()) {
+			RunStage(stage, *job);
+		}
+		chrono::duration<double> elapsed = Clock::now() - begin;
+		job->seconds[stage] = elapsed.count();
+		guard.lock();
+
+		if (stage != ENCODE) {
+			reserved[stage + 1]--;
+		}
+		if (stage == ENCODE || !job->error.empty()) {
+			chrono::duration<double> latency = Clock::now() - job->start;
+			Report(*job, latency.count());
+			completed++;
+		} else {
+			waiting[stage + 1].push_back(move(job));
+		}
+		changed.notify_all();
+	}
+}
+
+/**
+ * Runs one stage on job, setting job.error if it fails. Each stage frees
+ * what the next one does not need.
+ */
+void Batch::RunStage(unsigned int stage, BatchJob& job) const {
+	switch (stage) {
+	case DECODE:
+		if (!job.image.readFromFile(job.input)) {
+			job.error = "could not read " + job.input;
+		}
+		job.width = job.image.width();
+		job.height = job.image.height();
+		break;
+	case BUILD:
+		job.tree.reset(new QTree(job.image));
+		job.image = PNG();
+		break;
+	case TRANSFORM:
+		for (const BatchOp& op : config.ops) {
+			if (op.kind == BatchOp::PRUNE) {
+				job.tree->Prune(op.tolerance);
+			} else if (op.kind == BatchOp::FLIP) {
+				job.tree->FlipHorizontal();
+			} else {
+				job.tree->RotateCCW();
+			}
+		}
+		job.nodes = job.tree->NodeCount();
+		if (config.thumb > 0) {
+			// an odd number of rotations swaps the rendered sides
+			unsigned int rotations = count_if(config.ops.begin(), config.ops.end(),
+				[](const BatchOp& op) { return op.kind == BatchOp::ROTATE; });
+			unsigned int w = (rotations % 2 == 0) ? job.width : job.height;
+			unsigned int h = (rotations % 2 == 0) ? job.height : job.width;
+			unsigned int longest = max(w, h);
+			if (longest > config.thumb) {
+				w = max<uint64_t>(1, (uint64_t) w * config.thumb / longest);
+				h = max<uint64_t>(1, (uint64_t) h * config.thumb / longest);
+			}
+			job.image = job.tree->RenderDownscaled(w, h);
+		} else {
+			job.image = job.tree->Render(config.scale);
+		}
+		job.tree.reset();
+		break;
+	case ENCODE:
+		if (!job.image.writeToFile(job.output)) {
+			job.error = "could not write " + job.output;
+		}
+		job.image = PNG();
+		break;
+	}
+}
+
+/**
+ * Writes the result of one image as a line of the JSON output. Must be
+ * called with lock held, which also keeps lines from interleaving.
+ */
+void Batch::Report(const BatchJob& job, double latency) {
+	ostringstream line;
+	line << "    {\"input\": \"" << job.input << "\", \"output\": \"" << job.output << "\"";
+	if (job.error.empty()) {
+		line << ", \"width\": " << job.width << ", \"height\": " << job.height << ", \"nodes\": " << job.nodes;
+		pixels += (uint64_t) job.width * job.height;
+	} else {
+		line << ", \"error\": \"" << job.error << "\"";
+		failed++;
+	}
+	for (unsigned int s = 0; s < STAGES; s++) {
+		line << ", \"" << STAGE_NAMES[s] << "_s\": " << job.seconds[s];
+	}
+	line << ", \"latency_s\": " << latency << "}";
+	cout << (completed == 0 ? "" : ",\n") << line.str() << flush;
+	latencies.push_back(latency);
+}
+
+/**
+ * Reads the manifest at path into input/output pairs. Returns false if
+ * the file cannot be read or a line does not name two files.
+ */
+static bool ReadManifest(const string& path, vector<pair<string, string>>& manifest) {
+	ifstream in(path);
+	if (!in) {
+		cerr << "could not read manifest " << path << endl;
+		return false;
+	}
+	string line;
+	unsigned int number = 0;
+	while (getline(in, line)) {
+		number++;
+		istringstream fields(line);
+		string input, output;
+		if (!(fields >> input) || input[0] == '#') {
+			continue;
+		}
+		if (!(fields >> output)) {
+			cerr << path << ":" << number << ": expected an input and an output file" << endl;
+			return false;
+		}
+		manifest.push_back(make_pair(input, output));
+	}
+	return true;
+}
+
+/**
+ * Parses one op of the chain into config. Returns false if it is not
+ * one of the ops listed in the usage.
+ */
+static bool ParseOp(const string& arg, BatchConfig& config) {
+	BatchOp op;
+	if (arg.compare(0, 6, "prune=") == 0) {
+		op.kind = BatchOp::PRUNE;
+		op.tolerance = atof(arg.c_str() + 6);
+	} else if (arg == "flip") {
+		op.kind = BatchOp::FLIP;
+	} else if (arg == "rotate") {
+		op.kind = BatchOp::ROTATE;
+	} else if (arg.compare(0, 6, "scale=") == 0 && atoi(arg.c_str() + 6) > 0) {
+		config.scale = atoi(arg.c_str() + 6);
+		return true;
+	} else if (arg.compare(0, 6, "thumb=") == 0 && atoi(arg.c_str() + 6) > 0) {
+		config.thumb = atoi(arg.c_str() + 6);
+		return true;
+	} else {
+		return false;
+	}
+	config.ops.push_back(op);
+	return true;
+}
+
+/**
+ * Value at fraction q of the sorted values.
+ */
+static double Percentile(const vector<double>& sorted, double q) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	return sorted[min(sorted.size() - 1, (size_t) (q * sorted.size()))];
+}
+
+int main(int argc, char* argv[]) {
+	BatchConfig config;
+	config.threads = 0;
+	config.depth = 0;
+	config.scale = 1;
+	config.thumb = 0;
+	string manifestPath;
+
+	bool ok = true;
+	for (int i = 1; i < argc && ok; i++) {
+		if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+			config.threads = max(0, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+			config.depth = max(1, atoi(argv[++i]));
+		} else if (manifestPath.empty()) {
+			manifestPath = argv[i];
+		} else {
+			ok = ParseOp(argv[i], config);
+		}
+	}
+	if (!ok || manifestPath.empty()) {
+		cerr << "usage: " << argv[0] << " [-j threads] [-q depth] manifest [prune=TOL|flip|rotate|scale=N|thumb=N...]" << endl;
+		return 1;
+	}
+	if (config.threads == 0) {
+		config.threads = max(1u, thread::hardware_concurrency());
+	}
+	if (config.depth == 0) {
+		config.depth = config.threads;
+	}
+
+	vector<pair<string, string>> manifest;
+	if (!ReadManifest(manifestPath, manifest)) {
+		return 1;
+	}
+
+	cout << "{\n  \"threads\": " << config.threads << ",\n  \"depth\": " << config.depth << ",\n  \"results\": [\n";
+	Batch batch(config, manifest);
+	Clock::time_point start = Clock::now();
+	unsigned int failed = batch.Run();
+	chrono::duration<double> elapsed = Clock::now() - start;
+	cout << "\n  ]";
+
+	double seconds = elapsed.count();
+	size_t succeeded = manifest.size() - failed;
+	cout << ",\n  \"images\": " << manifest.size() << ",\n  \"failed\": " << failed << ",\n  \"seconds\": " << seconds;
+	if (seconds > 0) {
+		cout << ",\n  \"images_per_s\": " << succeeded / seconds << ",\n  \"pixels_per_s\": " << batch.Pixels() / seconds;
+	}
+	vector<double> latencies = batch.Latencies();
+	sort(latencies.begin(), latencies.end());
+	cout << ",\n  \"latency_p50_s\": " << Percentile(latencies, 0.5) << ",\n  \"latency_p95_s\": " << Percentile(latencies, 0.95)
+	     << ",\n  \"latency_max_s\": " << Percentile(latencies, 1.0);
+	cout << "\n}" << endl;
+	return failed == 0 ? 0 : 2;
+}
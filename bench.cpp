@@ -0,0 +1,337 @@
+/**
+ * Benchmarks for the QTree pipeline on synthetic images.
+ *
+ * Usage: bench [-r reps] [-p patterns] [megapixels...]
+ *   -r reps      runs per operation; the fastest is reported (default 3)
+ *   -p patterns  comma-separated subset of noise,gradient,flat (default all)
+ *   megapixels   image sizes to run, e.g. 1 10 100 (default 1 4 16)
+ *
+ * Results are written to stdout as JSON, one result per line, so runs of
+ * different releases can be diffed directly. Progress goes to stderr.
+ * Built with optimizations by `make bench`.
+ */
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "framesequence.h"
+#include "qtree.h"
+
+using namespace std;
+
+static const double PRUNE_TOLERANCE = 0.01;
+
+/**
+ * Parameters of one benchmark run.
+ */
+struct BenchConfig {
+	unsigned int reps;
+	vector<string> patterns;
+	vector<double> megapixels;
+};
+
+/**
+ * Small, fast generator for the noise pattern, so image generation does
+ * not dominate a run.
+ */
+static uint32_t NextRandom(uint32_t& state) {
+	state ^= state << 13;
+	state ^= state >> 17;
+	state ^= state << 5;
+	return state;
+}
+
+/**
+ * Fills a square image of about the given number of megapixels with one
+ * of the synthetic patterns:
+ *  - noise: every pixel random, the worst case for pruning;
+ *  - gradient: smooth ramps in each channel;
+ *  - flat: 64x64 blocks of solid color, like a UI screenshot.
+ */
+static PNG MakeImage(const string& pattern, double megapixels) {
+	unsigned int side = (unsigned int) std::sqrt(megapixels * 1000000.0);
+	PNG img(side, side);
+	uint32_t state = 2463534242u;
+	for (unsigned int y = 0; y < side; y++) {
+		RGBAPixel* row = img.getPixel(0, y);
+		for (unsigned int x = 0; x < side; x++) {
+			RGBAPixel& p = row[x];
+			if (pattern == "noise") {
+				uint32_t r = NextRandom(state);
+				p.r = r;
+				p.g = r >> 8;
+				p.b = r >> 16;
+			} else if (pattern == "gradient") {
+				p.r = (uint64_t) x * 255 / side;
+				p.g = (uint64_t) y * 255 / side;
+				p.b = (uint64_t) (x + y) * 255 / (2 * side);
+			} else {
+				uint32_t block = ((y / 64) * 40503u) ^ ((x / 64) * 2654435761u);
+				p.r = block % 4 * 60;
+				p.g = block / 4 % 4 * 60;
+				p.b = 200;
+			}
+		}
+	}
+	return img;
+}
+
+/**
+ * Tries to reset the kernel's record of this process's peak resident
+ * size, so the next reading covers only what runs in between. Returns
+ * false where that is not supported.
+ */
+static bool ResetPeakMemory() {
+	FILE* f = fopen("/proc/self/clear_refs", "w");
+	if (f == NULL) {
+		return false;
+	}
+	bool ok = fputs("5", f) >= 0;
+	return (fclose(f) == 0) && ok;
+}
+
+/**
+ * Peak resident size of the process in KiB: since the last successful
+ * ResetPeakMemory if /proc is available, otherwise since it started.
+ */
+static long PeakMemoryKB() {
+	ifstream status("/proc/self/status");
+	string line;
+	while (getline(status, line)) {
+		if (line.compare(0, 6, "VmHWM:") == 0) {
+			return atol(line.c_str() + 6);
+		}
+	}
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+}
+
+/**
+ * Runs setup() then op() reps times and returns the fastest time of op
+ * in seconds. setup is not timed.
+ */
+template <class Setup, class Op>
+static double Time(unsigned int reps, Setup setup, Op op) {
+	double best = 0;
+	for (unsigned int i = 0; i < reps; i++) {
+		setup();
+		auto start = chrono::steady_clock::now();
+		op();
+		chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+		if (i == 0 || elapsed.count() < best) {
+			best = elapsed.count();
+		}
+	}
+	return best;
+}
+
+/**
+ * Writes one result as a line of the JSON output. Throughputs are left
+ * out when the operation has nothing to count.
+ */
+static void Report(bool& first, const string& pattern, const PNG& img, const string& op,
+                   double seconds, unsigned long nodes, long peakKB) {
+	unsigned long pixels = (unsigned long) img.width() * img.height();
+	ostringstream line;
+	line << "    {\"pattern\": \"" << pattern << "\", \"width\": " << img.width() << ", \"height\": " << img.height()
+	     << ", \"op\": \"" << op << "\", \"seconds\": " << seconds;
+	if (seconds > 0) {
+		line << ", \"pixels_per_s\": " << (double) pixels / seconds;
+		if (nodes > 0) {
+			line << ", \"nodes_per_s\": " << (double) nodes / seconds;
+		}
+	}
+	line << ", \"nodes\": " << nodes << ", \"peak_kb\": " << peakKB << "}";
+	cout << (first ? "" : ",\n") << line.str() << flush;
+	first = false;
+}
+
+/**
+ * Times every operation of the pipeline on one image.
+ */
+static void RunImage(const BenchConfig& config, const string& pattern, const PNG& img, bool& first) {
+	unsigned int reps = config.reps;
+	cerr << pattern << " " << img.width() << "x" << img.height() << endl;
+
+	// each tree is destroyed before the next one is built, so peak memory
+	// is that of a single tree
+	vector<QTree> tree;
+	tree.reserve(1);
+	auto clear = [&tree]() { tree.clear(); };
+
+	ResetPeakMemory();
+	double seconds = Time(reps, clear, [&]() { tree.emplace_back(img); });
+	unsigned long nodes = tree[0].CountNodes();
+	Report(first, pattern, img, "build", seconds, nodes, PeakMemoryKB());
+
+	BuildOptions options;
+	clear();
+	ResetPeakMemory();
+	seconds = Time(reps, clear, [&]() { tree.emplace_back(img, options); });
+	Report(first, pattern, img, "build_parallel", seconds, nodes, PeakMemoryKB());
+
+	clear();
+	ResetPeakMemory();
+	seconds = Time(reps, clear, [&]() { tree.emplace_back(img, PRUNE_TOLERANCE); });
+	Report(first, pattern, img, "build_pruned", seconds, tree[0].CountNodes(), PeakMemoryKB());
+
+	// a frame of a recording: a 64x64 block of the last frame changes,
+	// somewhere else every time
+	{
+		FrameSequence frames(64);
+		frames.Next(img);
+		PNG frame(img);
+		unsigned int step = 0;
+		ResetPeakMemory();
+		seconds = Time(reps,
+			[&]() {
+				unsigned int x0 = (step * 97) % max(1u, frame.width() - 64);
+				unsigned int y0 = (step * 61) % max(1u, frame.height() - 64);
+				for (unsigned int y = y0; y < min(frame.height(), y0 + 64); y++) {
+					for (unsigned int x = x0; x < min(frame.width(), x0 + 64); x++) {
+						frame(x, y).r++;
+					}
+				}
+				step++;
+			},
+			[&]() { frames.Next(frame); });
+		Report(first, pattern, img, "frame_update", seconds, 0, PeakMemoryKB());
+	}
+
+	clear();
+	tree.emplace_back(img);
+	QTree& t = tree[0];
+	PNG out;
+	ResetPeakMemory();
+	seconds = Time(reps, []() {}, [&]() { out = t.Render(1); });
+	Report(first, pattern, img, "render", seconds, nodes, PeakMemoryKB());
+
+	RenderOptions renderOptions;
+	ResetPeakMemory();
+	seconds = Time(reps, []() {}, [&]() { out = t.Render(1, renderOptions); });
+	Report(first, pattern, img, "render_parallel", seconds, nodes, PeakMemoryKB());
+
+	unsigned int thumb = min(256u, min(img.width(), img.height()));
+	ResetPeakMemory();
+	seconds = Time(reps, []() {}, [&]() { out = t.RenderDownscaled(thumb, thumb); });
+	Report(first, pattern, img, "render_thumbnail", seconds, 0, PeakMemoryKB());
+
+	ResetPeakMemory();
+	seconds = Time(reps, []() {}, [&]() { t.FlipHorizontal(); });
+	Report(first, pattern, img, "flip", seconds, 0, PeakMemoryKB());
+
+	ResetPeakMemory();
+	seconds = Time(reps, []() {}, [&]() { t.RotateCCW(); });
+	Report(first, pattern, img, "rotate", seconds, 0, PeakMemoryKB());
+
+	t.RotateCCW();
+	ResetPeakMemory();
+	seconds = Time(reps, []() {}, [&]() { out = t.Render(1); });
+	Report(first, pattern, img, "render_rotated", seconds, nodes, PeakMemoryKB());
+
+	{
+		vector<QTree> copies;
+		copies.reserve(reps);
+		ResetPeakMemory();
+		seconds = Time(reps, []() {}, [&]() { copies.emplace_back(t); });
+		Report(first, pattern, img, "copy", seconds, nodes, PeakMemoryKB());
+	}
+
+	ResetPeakMemory();
+	seconds = Time(reps,
+		[&]() {
+			clear();
+			tree.emplace_back(img);
+		},
+		[&]() { tree[0].Prune(PRUNE_TOLERANCE); });
+	Report(first, pattern, img, "prune", seconds, nodes, PeakMemoryKB());
+	cerr << "  pruned to " << tree[0].CountNodes() << " of " << nodes << " nodes" << endl;
+
+	clear();
+	vector<unsigned char> encoded;
+	ResetPeakMemory();
+	seconds = Time(reps, []() {}, [&]() { img.writeToMemory(encoded); });
+	Report(first, pattern, img, "png_write", seconds, 0, PeakMemoryKB());
+
+	// cheapest settings short of storing: no filters, fixed codes, short
+	// window, RGBA kept as is; then the same writing indexed colors
+	PNGEncodeOptions fast;
+	fast.filter = PNGEncodeOptions::FILTER_NONE;
+	fast.level = PNGEncodeOptions::LEVEL_FAST;
+	fast.windowSize = 256;
+	fast.lazyMatching = false;
+	fast.autoConvert = false;
+	vector<unsigned char> encodedFast;
+	ResetPeakMemory();
+	seconds = Time(reps, [&]() { encodedFast.clear(); }, [&]() { img.writeToMemory(encodedFast, fast); });
+	Report(first, pattern, img, "png_write_fast", seconds, 0, PeakMemoryKB());
+
+	fast.palette = true;
+	ResetPeakMemory();
+	seconds = Time(reps, [&]() { encodedFast.clear(); }, [&]() { img.writeToMemory(encodedFast, fast); });
+	Report(first, pattern, img, "png_write_palette", seconds, 0, PeakMemoryKB());
+
+	PNG decoded;
+	ResetPeakMemory();
+	seconds = Time(reps, []() {}, [&]() { decoded.readFromMemory(encoded.data(), encoded.size()); });
+	Report(first, pattern, img, "png_read", seconds, 0, PeakMemoryKB());
+}
+
+/**
+ * Splits a comma-separated list.
+ */
+static vector<string> Split(const string& list) {
+	vector<string> items;
+	stringstream in(list);
+	string item;
+	while (getline(in, item, ',')) {
+		items.push_back(item);
+	}
+	return items;
+}
+
+int main(int argc, char* argv[]) {
+	BenchConfig config;
+	config.reps = 3;
+	config.patterns = Split("noise,gradient,flat");
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+			config.reps = max(1, atoi(argv[++i]));
+		} else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+			config.patterns = Split(argv[++i]);
+		} else if (atof(argv[i]) > 0) {
+			config.megapixels.push_back(atof(argv[i]));
+		} else {
+			cerr << "usage: " << argv[0] << " [-r reps] [-p noise,gradient,flat] [megapixels...]" << endl;
+			return 1;
+		}
+	}
+	if (config.megapixels.empty()) {
+		config.megapixels = { 1, 4, 16 };
+	}
+
+	cout << "{\n  \"reps\": " << config.reps << ",\n  \"prune_tolerance\": " << PRUNE_TOLERANCE
+	     << ",\n  \"peak_scope\": \"" << (ResetPeakMemory() ? "operation" : "process") << "\",\n  \"results\": [\n";
+	bool first = true;
+	for (double mp : config.megapixels) {
+		for (const string& pattern : config.patterns) {
+			PNG img = MakeImage(pattern, mp);
+			RunImage(config, pattern, img, first);
+		}
+	}
+	cout << "\n  ]\n}" << endl;
+	return 0;
+}
@@ -0,0 +1,37 @@
+#ifndef _COLORKERNEL_H_
+#define _COLORKERNEL_H_
+
+#include <cstdint>
+#include "cs221util/RGBAPixel.h"
+
+using namespace cs221util;
+
+/**
+ * Sets avg's red, green and blue to the area-weighted average of the N
+ * child colors, truncated toward zero; avg's alpha is left as it is.
+ * This is how both QTree and CompactQTree combine their children's
+ * averages in constant time. The weighted sums are kept in 64 bits so
+ * they cannot overflow, however large the image.
+ *
+ * @param avg the parent's color
+ * @param colors the children's average colors
+ * @param areas the number of pixels in each child's rectangle
+ */
+template <unsigned int N>
+inline void CombineAverages(RGBAPixel& avg, const RGBAPixel* const (&colors)[N], const uint64_t (&areas)[N]) {
+    uint64_t r = 0;
+    uint64_t g = 0;
+    uint64_t b = 0;
+    uint64_t totalArea = 0;
+    for (unsigned int k = 0; k < N; k++) {
+        r += areas[k] * colors[k]->r;
+        g += areas[k] * colors[k]->g;
+        b += areas[k] * colors[k]->b;
+        totalArea += areas[k];
+    }
+    avg.r = r / totalArea;
+    avg.g = g / totalArea;
+    avg.b = b / totalArea;
+}
+
+#endif
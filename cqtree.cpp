@@ -0,0 +1,650 @@
+#include "cqtree.h"
+#include "colorkernel.h"
+#include "qtree.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Splits the rectangle ul..lr the way QTree::BuildNode does, and returns
+ * the rectangle of child k (0 = NW, 1 = NE, 2 = SW, 3 = SE) in cul..clr.
+ * The extra line of an uneven split goes to the left/upper side.
+ */
+static void ChildRect(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int k,
+                      pair<unsigned int, unsigned int>& cul, pair<unsigned int, unsigned int>& clr) {
+	unsigned int halfw = (lr.first - ul.first + 2) / 2;
+	unsigned int halfh = (lr.second - ul.second + 2) / 2;
+
+	cul.first = (k & 1) ? ul.first + halfw : ul.first;
+	clr.first = (k & 1) ? lr.first : ul.first + halfw - 1;
+	cul.second = (k & 2) ? ul.second + halfh : ul.second;
+	clr.second = (k & 2) ? lr.second : ul.second + halfh - 1;
+}
+
+/**
+ * Mask of the children that a node covering a w x h rectangle has in
+ * an unpruned tree: 1-pixel-wide rectangles have no eastern children and
+ * 1-pixel-tall rectangles have no southern children.
+ */
+static unsigned int ShapeMask(unsigned int w, unsigned int h) {
+	if (w == 1 && h == 1) {
+		return 0;
+	} else if (w == 1) {
+		return 1 | 4;
+	} else if (h == 1) {
+		return 1 | 2;
+	} else {
+		return 1 | 2 | 4 | 8;
+	}
+}
+
+/**
+ * Constructor that builds a CompactQTree out of the given PNG.
+ * The number of nodes on each level only depends on the image's
+ * dimensions, so the levels are sized first and then filled in by a
+ * depth-first build, which visits the nodes of each level in
+ * breadth-first order.
+ */
+CompactQTree::CompactQTree(const PNG& imIn) : orientation(imIn.width(), imIn.height()) {
+	width = imIn.width();
+	height = imIn.height();
+	leaves = 0;
+
+	// every level holds at most two distinct widths and two distinct heights
+	vector<unsigned int> next;
+	map<pair<unsigned int, unsigned int>, unsigned int> level;
+	level[make_pair(width, height)] = 1;
+	unsigned int total = 0;
+	while (!level.empty()) {
+		map<pair<unsigned int, unsigned int>, unsigned int> below;
+		next.push_back(total);
+		for (map<pair<unsigned int, unsigned int>, unsigned int>::iterator it = level.begin(); it != level.end(); it++) {
+			unsigned int w = it->first.first;
+			unsigned int h = it->first.second;
+			unsigned int mask = ShapeMask(w, h);
+			total += it->second;
+			for (unsigned int k = 0; k < 4; k++) {
+				if (mask & (1 << k)) {
+					unsigned int halfw = (w + 1) / 2;
+					unsigned int halfh = (h + 1) / 2;
+					below[make_pair((k & 1) ? w - halfw : halfw, (k & 2) ? h - halfh : halfh)] += it->second;
+				}
+			}
+		}
+		level.swap(below);
+	}
+
+	colors.resize(total);
+	masks.assign((total + 15) / 16, 0);
+	BuildNode(imIn, make_pair(0, 0), make_pair(width - 1, height - 1), 0, next);
+	BuildRanks();
+	Attach();
+}
+
+CompactQTree::CompactQTree() {
+	width = 0;
+	height = 0;
+	leaves = 0;
+	Attach();
+}
+
+/**
+ * Stores tree in the compact layout by walking it breadth first; a
+ * pruned node is simply a node with no children.
+ */
+CompactQTree::CompactQTree(const QTree& tree) : orientation(tree.orientation) {
+	width = 0;
+	height = 0;
+	leaves = 0;
+
+	if (tree.root != NULL) {
+		width = tree.root->lowRight.first + 1;
+		height = tree.root->lowRight.second + 1;
+
+		vector<const Node*> queue(1, tree.root);
+		for (size_t q = 0; q < queue.size(); q++) {
+			const Node* nd = queue[q];
+			const Node* children[4] = { nd->NW, nd->NE, nd->SW, nd->SE };
+			unsigned int mask = 0;
+			for (unsigned int k = 0; k < 4; k++) {
+				if (children[k] != NULL) {
+					mask |= 1 << k;
+					queue.push_back(children[k]);
+				}
+			}
+			if (mask == 0) {
+				leaves++;
+			}
+			Append(colors, masks, nd->avg, mask);
+		}
+	}
+
+	BuildRanks();
+	Attach();
+}
+
+CompactQTree::CompactQTree(const CompactQTree& other)
+	: width(other.width), height(other.height), leaves(other.leaves),
+	  colors(other.colors), masks(other.masks), ranks(other.ranks),
+	  nodes(other.nodes), colorData(other.colorData), maskData(other.maskData), rankData(other.rankData),
+	  file(other.file), orientation(other.orientation) {
+	if (file == NULL) {
+		Attach();
+	}
+}
+
+CompactQTree& CompactQTree::operator=(const CompactQTree& other) {
+	if (this != &other) {
+		CompactQTree copy(other);
+		std::swap(width, copy.width);
+		std::swap(height, copy.height);
+		std::swap(leaves, copy.leaves);
+		colors.swap(copy.colors);
+		masks.swap(copy.masks);
+		ranks.swap(copy.ranks);
+		file.swap(copy.file);
+		orientation = copy.orientation;
+		if (file == NULL) {
+			Attach();
+		} else {
+			nodes = copy.nodes;
+			colorData = copy.colorData;
+			maskData = copy.maskData;
+			rankData = copy.rankData;
+		}
+	}
+	return *this;
+}
+
+/**
+ * Builds the subtree covering ul..lr, whose root is the next unfilled
+ * node of the given level, and returns the subtree's average color.
+ * Averages are combined exactly as QTree::assignColor does.
+ */
+RGBAPixel CompactQTree::BuildNode(const PNG& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                                            unsigned int level, vector<unsigned int>& next) {
+	unsigned int i = next[level]++;
+	unsigned int mask = ShapeMask(lr.first - ul.first + 1, lr.second - ul.second + 1);
+
+	RGBAPixel avg;
+	if (mask == 0) {
+		avg = img(ul.first, ul.second);
+		leaves++;
+	} else {
+		const RGBAPixel* childColors[4];
+		uint64_t areas[4];
+		RGBAPixel built[4];
+		unsigned int n = 0;
+		for (unsigned int k = 0; k < 4; k++) {
+			if (mask & (1 << k)) {
+				pair<unsigned int, unsigned int> cul, clr;
+				ChildRect(ul, lr, k, cul, clr);
+				built[n] = BuildNode(img, cul, clr, level + 1, next);
+				childColors[n] = &built[n];
+				areas[n] = (uint64_t) (clr.second - cul.second + 1) * (clr.first - cul.first + 1);
+				n++;
+			}
+		}
+		if (n == 4) {
+			CombineAverages(avg, childColors, areas);
+		} else {
+			const RGBAPixel* pairColors[2] = { childColors[0], childColors[1] };
+			const uint64_t pairAreas[2] = { areas[0], areas[1] };
+			CombineAverages(avg, pairColors, pairAreas);
+		}
+	}
+
+	colors[i] = avg;
+	masks[i / 16] |= (uint64_t) mask << (4 * (i % 16));
+	return avg;
+}
+
+/**
+ * Points the arrays read by queries at the tree's own vectors.
+ */
+void CompactQTree::Attach() {
+	file.reset();
+	nodes = colors.size();
+	colorData = colors.data();
+	maskData = masks.data();
+	rankData = ranks.data();
+}
+
+/**
+ * Recomputes the rank directory: for every mask word, the number of
+ * children of all nodes in earlier words.
+ */
+void CompactQTree::BuildRanks() {
+	ranks.resize(masks.size());
+	uint32_t count = 0;
+	for (unsigned int w = 0; w < masks.size(); w++) {
+		ranks[w] = count;
+		count += __builtin_popcountll(masks[w]);
+	}
+}
+
+unsigned int CompactQTree::Mask(unsigned int i) const {
+	return (maskData[i / 16] >> (4 * (i % 16))) & 15;
+}
+
+/**
+ * Index of the first child of node i: the root is node 0, and the
+ * children of node i come right after the children of nodes 0..i-1.
+ */
+unsigned int CompactQTree::FirstChild(unsigned int i) const {
+	unsigned int shift = 4 * (i % 16);
+	uint64_t before = shift == 0 ? 0 : maskData[i / 16] & ((1ULL << shift) - 1);
+	return 1 + rankData[i / 16] + __builtin_popcountll(before);
+}
+
+/**
+ * Appends a node to the end of the breadth-first arrays cs/ms.
+ */
+void CompactQTree::Append(vector<RGBAPixel>& cs, vector<uint64_t>& ms, RGBAPixel c, unsigned int mask) {
+	unsigned int i = cs.size();
+	cs.push_back(c);
+	if (i % 16 == 0) {
+		ms.push_back(0);
+	}
+	ms[i / 16] |= (uint64_t) mask << (4 * (i % 16));
+}
+
+/**
+ * Counts the number of nodes in the tree
+ */
+unsigned int CompactQTree::CountNodes() const {
+	return nodes;
+}
+
+/**
+ * Counts the number of leaves in the tree
+ */
+unsigned int CompactQTree::CountLeaves() const {
+	return leaves;
+}
+
+/**
+ * Render returns a PNG image consisting of the pixels
+ * stored in the tree, drawn in the tree's current orientation.
+ *
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @pre scale > 0
+ */
+PNG CompactQTree::Render(unsigned int scale) const {
+	PNG img(orientation.Width() * scale, orientation.Height() * scale);
+	if (nodes == 0) {
+		return img;
+	}
+	RenderNode(img, 0, make_pair(0, 0), make_pair(width - 1, height - 1), scale);
+	return img;
+}
+
+/**
+ * Paints the leaves of the subtree rooted at node i, which covers ul..lr
+ * in the tree's build orientation.
+ */
+void CompactQTree::RenderNode(PNG& img, unsigned int i, pair<unsigned int, unsigned int> ul,
+                              pair<unsigned int, unsigned int> lr, unsigned int scale) const {
+	unsigned int mask = Mask(i);
+	if (mask != 0) {
+		unsigned int child = FirstChild(i);
+		for (unsigned int k = 0; k < 4; k++) {
+			if (mask & (1 << k)) {
+				pair<unsigned int, unsigned int> cul, clr;
+				ChildRect(ul, lr, k, cul, clr);
+				RenderNode(img, child++, cul, clr, scale);
+			}
+		}
+		return;
+	}
+
+	orientation.MapRect(ul, lr);
+	unsigned int x0 = ul.first * scale;
+	unsigned int y0 = ul.second * scale;
+	unsigned int x = (lr.first - ul.first + 1) * scale;
+	unsigned int y = (lr.second - ul.second + 1) * scale;
+
+	const RGBAPixel& color = colorData[i];
+	for (unsigned int j = y0; j < y0 + y; j++) {
+		RGBAPixel* row = img.getRow(j) + x0;
+		std::fill(row, row + x, color);
+	}
+}
+
+/**
+ * Trims subtrees as high as possible in the tree, using the same
+ * criterion as QTree::Prune. The surviving nodes keep their relative
+ * breadth-first order, so the pruned tree is written out in a single
+ * pass over the old arrays.
+ *
+ * @param tolerance maximum RGBA distance to qualify for pruning
+ * @pre this tree has not previously been pruned.
+ */
+void CompactQTree::Prune(double tolerance) {
+	vector<RGBAPixel> prunedColors;
+	vector<uint64_t> prunedMasks;
+	unsigned int prunedLeaves = 0;
+
+	vector<bool> alive(nodes, false);
+	if (nodes > 0) {
+		alive[0] = true;
+	}
+	for (unsigned int i = 0; i < nodes; i++) {
+		if (!alive[i]) {
+			continue;
+		}
+		unsigned int mask = Mask(i);
+		unsigned int kept = mask;
+		if (mask != 0 && WithinTolerance(i, colorData[i], tolerance)) {
+			kept = 0;
+		}
+		Append(prunedColors, prunedMasks, colorData[i], kept);
+		if (kept == 0) {
+			prunedLeaves++;
+		} else {
+			unsigned int child = FirstChild(i);
+			for (unsigned int k = 0; k < 4; k++) {
+				if (mask & (1 << k)) {
+					alive[child++] = true;
+				}
+			}
+		}
+	}
+
+	colors.swap(prunedColors);
+	masks.swap(prunedMasks);
+	leaves = prunedLeaves;
+	BuildRanks();
+	Attach();
+}
+
+/**
+ * Returns true if every leaf below node i is within tolerance of a.
+ * In breadth-first order the descendants of i on each level form one
+ * contiguous run of colors, so each level is checked with a single batch
+ * distance call; internal nodes in the run are measured but ignored.
+ */
+bool CompactQTree::WithinTolerance(unsigned int i, RGBAPixel a, double tolerance) const {
+	const unsigned int BLOCK = 64;
+	double distances[BLOCK];
+	unsigned int size = nodes;
+
+	unsigned int lo = i;
+	unsigned int hi = i + 1;
+	while (lo < hi) {
+		for (unsigned int n = lo; n < hi; n += BLOCK) {
+			unsigned int count = min(BLOCK, hi - n);
+			distancesTo(a, colorData + n, count, distances);
+			for (unsigned int j = 0; j < count; j++) {
+				if (distances[j] > tolerance && Mask(n + j) == 0) {
+					return false;
+				}
+			}
+		}
+		unsigned int below = FirstChild(lo);
+		hi = (hi >= size) ? size : FirstChild(hi);
+		lo = below;
+	}
+	return true;
+}
+
+/**
+ * Mirrors the rendered image across a vertical axis in constant time.
+ */
+void CompactQTree::FlipHorizontal() {
+	orientation.FlipHorizontal();
+}
+
+/**
+ * Rotates the rendered image by 90 degrees counter-clockwise in
+ * constant time.
+ */
+void CompactQTree::RotateCCW() {
+	orientation.RotateCCW();
+}
+
+/**
+ * Header of the file format written by WriteToFile. It is followed by
+ * the mask words, one rank per mask word, and one RGBA8 color per node,
+ * in that order; each array starts suitably aligned for its type.
+ */
+struct CompactQTreeHeader {
+	char magic[4];      // "CQTR"
+	uint32_t byteOrder; // FILE_BYTE_ORDER as written by the writer
+	uint32_t version;   // FILE_VERSION
+	uint32_t width;     // dimensions of the image, as built
+	uint32_t height;
+	uint32_t nodes;
+	uint32_t leaves;
+	uint32_t orientation; // Orientation::Code() of the pending orientation
+};
+
+static_assert(sizeof(CompactQTreeHeader) == 32, "CompactQTreeHeader has no padding");
+
+static const char FILE_MAGIC[4] = { 'C', 'Q', 'T', 'R' };
+static const uint32_t FILE_BYTE_ORDER = 0x01020304;
+static const uint32_t FILE_VERSION = 1;
+
+/**
+ * Number of bytes a file holding the given number of nodes takes.
+ */
+static size_t FileSize(uint64_t nodes) {
+	uint64_t words = (nodes + 15) / 16;
+	return sizeof(CompactQTreeHeader) + words * sizeof(uint64_t) + words * sizeof(uint32_t) + nodes * sizeof(RGBAPixel);
+}
+
+/**
+ * Writes the tree to a file in a versioned binary format; see cqtree.h.
+ *
+ * @param fileName Name of the file to be written.
+ * @return true, if the tree was successfully written.
+ */
+bool CompactQTree::WriteToFile(string const & fileName) const {
+	CompactQTreeHeader header;
+	memcpy(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC));
+	header.byteOrder = FILE_BYTE_ORDER;
+	header.version = FILE_VERSION;
+	header.width = width;
+	header.height = height;
+	header.nodes = nodes;
+	header.leaves = leaves;
+	header.orientation = orientation.Code();
+
+	FILE* out = fopen(fileName.c_str(), "wb");
+	if (out == NULL) {
+		cerr << "CompactQTree: could not open " << fileName << " for writing" << endl;
+		return false;
+	}
+	size_t words = (nodes + 15) / 16;
+	bool ok = fwrite(&header, sizeof(header), 1, out) == 1
+	       && fwrite(maskData, sizeof(uint64_t), words, out) == words
+	       && fwrite(rankData, sizeof(uint32_t), words, out) == words
+	       && fwrite(colorData, sizeof(RGBAPixel), nodes, out) == nodes;
+	ok = (fclose(out) == 0) && ok;
+	if (!ok) {
+		cerr << "CompactQTree: could not write " << fileName << endl;
+	}
+	return ok;
+}
+
+/**
+ * Maps fileName into memory, or failing that reads it into a buffer
+ * aligned for the arrays. Returns the file's contents, or an empty
+ * pointer if it could not be read.
+ */
+static shared_ptr<const unsigned char> LoadFile(string const & fileName, size_t& size) {
+	size = 0;
+#if defined(__unix__) || defined(__APPLE__)
+	int fd = open(fileName.c_str(), O_RDONLY);
+	if (fd >= 0) {
+		struct stat info;
+		if (fstat(fd, &info) == 0 && info.st_size > 0) {
+			void* mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+			if (mapped != MAP_FAILED) {
+				close(fd);
+				size_t length = info.st_size;
+				size = length;
+				return shared_ptr<const unsigned char>(static_cast<const unsigned char*>(mapped),
+				                                       [length](const unsigned char* p) { munmap((void*) p, length); });
+			}
+		}
+		close(fd);
+	}
+#endif
+
+	FILE* in = fopen(fileName.c_str(), "rb");
+	if (in == NULL) {
+		return shared_ptr<const unsigned char>();
+	}
+	vector<unsigned char> bytes;
+	unsigned char chunk[65536];
+	size_t got;
+	while ((got = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+		bytes.insert(bytes.end(), chunk, chunk + got);
+	}
+	fclose(in);
+
+	uint64_t* buffer = new uint64_t[(bytes.size() + 7) / 8 + 1];
+	if (!bytes.empty()) {
+		// an empty file leaves bytes.data() null, which memcpy must not get
+		memcpy(buffer, bytes.data(), bytes.size());
+	}
+	size = bytes.size();
+	return shared_ptr<const unsigned char>(reinterpret_cast<const unsigned char*>(buffer),
+	                                       [](const unsigned char* p) { delete[] reinterpret_cast<const uint64_t*>(p); });
+}
+
+/**
+ * Walks the tree held in the arrays ms/rs of a file from the root, giving
+ * every node the rectangle it covers in a width x height image, and
+ * checks that each node has only children its rectangle can be split
+ * into, that children come after their parent and inside the arrays, and
+ * that every node is reached. Counts the leaves into leaves.
+ * Returns false if the arrays do not describe such a tree.
+ */
+static bool CheckShape(const uint64_t* ms, const uint32_t* rs, uint32_t nodes, uint32_t width, uint32_t height,
+                       unsigned int& leaves) {
+	struct Pending {
+		uint32_t index;
+		pair<unsigned int, unsigned int> ul;
+		pair<unsigned int, unsigned int> lr;
+	};
+	vector<Pending> stack;
+	stack.push_back({ 0, make_pair(0u, 0u), make_pair(width - 1, height - 1) });
+	uint64_t reached = 0;
+	leaves = 0;
+	while (!stack.empty()) {
+		Pending nd = stack.back();
+		stack.pop_back();
+		reached++;
+
+		unsigned int shift = 4 * (nd.index % 16);
+		unsigned int mask = (ms[nd.index / 16] >> shift) & 15;
+		unsigned int w = nd.lr.first - nd.ul.first + 1;
+		unsigned int h = nd.lr.second - nd.ul.second + 1;
+		if ((mask & ~ShapeMask(w, h)) != 0) {
+			return false;
+		}
+		if (mask == 0) {
+			leaves++;
+			continue;
+		}
+
+		uint64_t before = shift == 0 ? 0 : ms[nd.index / 16] & ((1ULL << shift) - 1);
+		uint64_t child = 1 + (uint64_t) rs[nd.index / 16] + __builtin_popcountll(before);
+		if (child <= nd.index || child + __builtin_popcount(mask) > nodes) {
+			return false;
+		}
+		for (unsigned int k = 0; k < 4; k++) {
+			if (mask & (1 << k)) {
+				Pending next;
+				next.index = child++;
+				ChildRect(nd.ul, nd.lr, k, next.ul, next.lr);
+				stack.push_back(next);
+			}
+		}
+	}
+	return reached == nodes;
+}
+
+/**
+ * Loads a tree written by WriteToFile, replacing this one. The header,
+ * the file size, the rank directory and every node's children (against
+ * the shape of its rectangle) are checked before the tree is replaced,
+ * and the leaves are recounted rather than taken from the header, in
+ * one pass over the nodes; the arrays are then used in place.
+ *
+ * @param fileName Name of the file to be read.
+ * @return true, if the file held a valid tree and was loaded.
+ */
+bool CompactQTree::ReadFromFile(string const & fileName) {
+	size_t size;
+	shared_ptr<const unsigned char> data = LoadFile(fileName, size);
+	if (data == NULL) {
+		cerr << "CompactQTree: could not read " << fileName << endl;
+		return false;
+	}
+
+	CompactQTreeHeader header;
+	if (size < sizeof(header)) {
+		cerr << "CompactQTree: " << fileName << " is too short" << endl;
+		return false;
+	}
+	memcpy(&header, data.get(), sizeof(header));
+	if (memcmp(header.magic, FILE_MAGIC, sizeof(FILE_MAGIC)) != 0 || header.byteOrder != FILE_BYTE_ORDER) {
+		cerr << "CompactQTree: " << fileName << " is not a tree file for this machine" << endl;
+		return false;
+	}
+	if (header.version != FILE_VERSION) {
+		cerr << "CompactQTree: " << fileName << " has unsupported version " << header.version << endl;
+		return false;
+	}
+	if (header.nodes == 0 || header.width == 0 || header.height == 0 || header.orientation >= 8
+	    || size != FileSize(header.nodes)) {
+		cerr << "CompactQTree: " << fileName << " is corrupt" << endl;
+		return false;
+	}
+
+	size_t words = (header.nodes + 15) / 16;
+	const uint64_t* ms = reinterpret_cast<const uint64_t*>(data.get() + sizeof(header));
+	const uint32_t* rs = reinterpret_cast<const uint32_t*>(ms + words);
+	const RGBAPixel* cs = reinterpret_cast<const RGBAPixel*>(rs + words);
+
+	// every child index must stay inside the arrays
+	uint64_t count = 0;
+	for (size_t w = 0; w < words; w++) {
+		if (rs[w] != count) {
+			cerr << "CompactQTree: " << fileName << " is corrupt" << endl;
+			return false;
+		}
+		count += __builtin_popcountll(ms[w]);
+	}
+	unsigned int leafCount = 0;
+	if (count != header.nodes - 1 || !CheckShape(ms, rs, header.nodes, header.width, header.height, leafCount)) {
+		cerr << "CompactQTree: " << fileName << " is corrupt" << endl;
+		return false;
+	}
+
+	colors.clear();
+	masks.clear();
+	ranks.clear();
+	width = header.width;
+	height = header.height;
+	leaves = leafCount;
+	orientation = Orientation(width, height, header.orientation);
+
+	file = data;
+	nodes = header.nodes;
+	colorData = cs;
+	maskData = ms;
+	rankData = rs;
+	return true;
+}
@@ -0,0 +1,173 @@
+#ifndef _CQTREE_H_
+#define _CQTREE_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+#include "cs221util/PNG.h"
+#include "cs221util/RGBAPixel.h"
+#include "orientation.h"
+
+using namespace std;
+using namespace cs221util;
+
+class QTree;
+
+/**
+ * CompactQTree is an alternative, pointer-free storage layout for the
+ * quadtree built by QTree. It represents exactly the same tree (same
+ * splits, same average colors, same pruning rule), but:
+ *
+ *  - nodes live in one flat array in breadth-first order;
+ *  - a node's rectangle is not stored, it is derived on the fly from the
+ *    root rectangle and the split rule of the QTree constructor;
+ *  - a node's children are found by index arithmetic: every node has a
+ *    4-bit mask of which of its NW/NE/SW/SE children exist, and since the
+ *    children of node i in breadth-first order begin right after the
+ *    children of nodes 0..i-1, the first child's index is a rank
+ *    (population count) over the masks of all earlier nodes.
+ *
+ * Each node costs its 4-byte color plus about one byte of mask and rank
+ * directory, compared to the ~64 bytes of a QTree Node.
+ *
+ * Since rectangles are derived from the split rule, the array always stays
+ * in the orientation it was built in; FlipHorizontal and RotateCCW only
+ * record the pending orientation, which Render applies.
+ *
+ * The arrays are also the tree's file format (see WriteToFile), so a
+ * saved tree is loaded by mapping the file and using the arrays where
+ * they lie, without decoding or rebuilding anything; loading only makes
+ * one pass over the nodes to check them.
+ */
+class CompactQTree {
+public:
+    /**
+     * Constructor that builds a CompactQTree out of the given PNG.
+     * The tree has the same shape and average colors as QTree(imIn).
+     */
+    CompactQTree(const PNG& imIn);
+
+    /**
+     * Constructs an empty tree, e.g. to be loaded with ReadFromFile.
+     */
+    CompactQTree();
+
+    /**
+     * Constructor that stores the given QTree, as it is now (pruned or
+     * not, flipped or rotated or not), in the compact layout.
+     */
+    CompactQTree(const QTree& tree);
+
+    /**
+     * Copy constructor and assignment. A tree loaded from a file shares
+     * the mapped file with its copies.
+     */
+    CompactQTree(const CompactQTree& other);
+    CompactQTree& operator=(const CompactQTree& other);
+
+    /**
+     * Counts the number of nodes in the tree
+     */
+    unsigned int CountNodes() const;
+
+    /**
+     * Counts the number of leaves in the tree
+     */
+    unsigned int CountLeaves() const;
+
+    /**
+     * Render returns a PNG image consisting of the pixels
+     * stored in the tree, drawn in the tree's current orientation.
+     * See QTree::Render.
+     *
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @pre scale > 0
+     */
+    PNG Render(unsigned int scale) const;
+
+    /**
+     * Trims subtrees as high as possible in the tree, using the same
+     * criterion as QTree::Prune.
+     *
+     * @param tolerance maximum RGBA distance to qualify for pruning
+     * @pre this tree has not previously been pruned.
+     */
+    void Prune(double tolerance);
+
+    /**
+     * Mirrors the rendered image across a vertical axis in constant time.
+     */
+    void FlipHorizontal();
+
+    /**
+     * Rotates the rendered image by 90 degrees counter-clockwise in
+     * constant time.
+     */
+    void RotateCCW();
+
+    /**
+     * Writes the tree to a file in a versioned binary format: a 32-byte
+     * header (magic, byte order, version, dimensions, node and leaf
+     * counts, orientation) followed by the child masks, the rank
+     * directory and the RGBA8 colors, each exactly as held in memory.
+     * No rectangles are stored. About 4.75 bytes per node.
+     *
+     * @param fileName Name of the file to be written.
+     * @return true, if the tree was successfully written.
+     */
+    bool WriteToFile(string const & fileName) const;
+
+    /**
+     * Loads a tree written by WriteToFile, replacing this one. The file is
+     * memory-mapped where the platform allows, and the tree reads its
+     * arrays straight out of the mapping rather than copying them. Before
+     * that, every node's children are checked against its rectangle, so
+     * loading takes time linear in the number of nodes, and a damaged
+     * file is rejected. Pruning a loaded tree copies it into memory first.
+     *
+     * @param fileName Name of the file to be read.
+     * @return true, if the file held a valid tree and was loaded.
+     */
+    bool ReadFromFile(string const & fileName);
+
+private:
+    unsigned int width;  // width of PNG represented by the tree, as built
+    unsigned int height; // height of PNG represented by the tree, as built
+    unsigned int leaves; // number of nodes with no children
+
+    vector<RGBAPixel> colors; // average color of each node, breadth-first order
+    vector<uint64_t> masks;   // 4-bit child masks (NW=1, NE=2, SW=4, SE=8), 16 nodes per word
+    vector<uint32_t> ranks;   // number of children of all nodes in earlier mask words
+
+    // the arrays as read by every query: either the vectors above, or the
+    // same arrays inside a file loaded by ReadFromFile
+    unsigned int nodes;
+    const RGBAPixel* colorData;
+    const uint64_t* maskData;
+    const uint32_t* rankData;
+    shared_ptr<const unsigned char> file; // loaded file the arrays point into, if any
+
+    Orientation orientation; // pending flips/rotations, applied by Render
+
+    unsigned int Mask(unsigned int i) const;
+
+    unsigned int FirstChild(unsigned int i) const;
+
+    static void Append(vector<RGBAPixel>& cs, vector<uint64_t>& ms, RGBAPixel c, unsigned int mask);
+
+    void BuildRanks();
+
+    void Attach();
+
+    RGBAPixel BuildNode(const PNG& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                    unsigned int level, vector<unsigned int>& next);
+
+    void RenderNode(PNG& img, unsigned int i, pair<unsigned int, unsigned int> ul,
+                    pair<unsigned int, unsigned int> lr, unsigned int scale) const;
+
+    bool WithinTolerance(unsigned int i, RGBAPixel a, double tolerance) const;
+};
+
+#endif
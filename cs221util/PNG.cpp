@@ -9,21 +9,78 @@
 #include <iostream>
 #include <string>
 #include <algorithm>
-#include <functional>
+#include <chrono>
+#include <memory>
+#include <new>
 #include <cassert>
+#include <cstdlib>
+#include <cstring>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "lodepng/lodepng.h"
 #include "PNG.h"
 //#include "RGB_HSL.h"
 
 namespace cs221util {
+#ifdef QTREE_STATS
+  static double secondsSince(std::chrono::steady_clock::time_point start) {
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count();
+  }
+#endif
+
+  PNGStats::PNGStats() {
+    bytesDecoded = 0;
+    bytesEncoded = 0;
+    decodeSeconds = 0;
+    encodeSeconds = 0;
+  }
+
+  PNGEncodeOptions::PNGEncodeOptions() {
+    filter = FILTER_MINSUM;
+    level = LEVEL_DEFAULT;
+    windowSize = 2048;
+    lazyMatching = true;
+    autoConvert = true;
+    palette = false;
+  }
+
+  /*
+   * Pixel buffers are allocated with malloc rather than new[] so that a
+   * PNG can adopt the buffer lodepng decodes into (lodepng allocates with
+   * malloc) instead of copying it. RGBAPixel is trivially destructible,
+   * so free is all a buffer needs.
+   */
+  RGBAPixel * PNG::_allocatePixels(std::size_t count) {
+    if (count == 0) { return NULL; }
+    RGBAPixel * pixels = static_cast<RGBAPixel *>(malloc(count * sizeof(RGBAPixel)));
+    if (pixels == NULL) { throw std::bad_alloc(); }
+    std::uninitialized_fill(pixels, pixels + count, RGBAPixel());
+    return pixels;
+  }
+
+  RGBAPixel * PNG::_reallocatePixels(RGBAPixel * pixels, std::size_t count) {
+    RGBAPixel * resized = static_cast<RGBAPixel *>(realloc(pixels, count * sizeof(RGBAPixel)));
+    if (resized == NULL) { throw std::bad_alloc(); }
+    return resized;
+  }
+
+  void PNG::_freePixels(RGBAPixel * pixels) {
+    free(pixels);
+  }
+
   void PNG::_copy(PNG const & other) {
     // Clear self
-    delete[] imageData_;
+    _freePixels(imageData_);
 
     // Copy `other` to self
     width_ = other.width_;
     height_ = other.height_;
-    imageData_ = new RGBAPixel[width_ * height_];
+    imageData_ = _allocatePixels(width_ * height_);
     for (unsigned i = 0; i < width_ * height_; i++) {
       imageData_[i] = other.imageData_[i];
     }
@@ -38,7 +95,7 @@ namespace cs221util {
   PNG::PNG(unsigned int width, unsigned int height) {
     width_ = width;
     height_ = height;
-    imageData_ = new RGBAPixel[width * height];
+    imageData_ = _allocatePixels(width * height);
   }
 
   PNG::PNG(PNG const & other) {
@@ -46,8 +103,18 @@ namespace cs221util {
     _copy(other);
   }
 
+  PNG::PNG(PNG && other) noexcept {
+    width_ = other.width_;
+    height_ = other.height_;
+    imageData_ = other.imageData_;
+
+    other.width_ = 0;
+    other.height_ = 0;
+    other.imageData_ = NULL;
+  }
+
   PNG::~PNG() {
-    delete[] imageData_;
+    _freePixels(imageData_);
   }
 
   PNG const & PNG::operator=(PNG const & other) {
@@ -55,14 +122,34 @@ namespace cs221util {
     return *this;
   }
 
+  PNG & PNG::operator=(PNG && other) noexcept {
+    if (this != &other) {
+      _freePixels(imageData_);
+
+      width_ = other.width_;
+      height_ = other.height_;
+      imageData_ = other.imageData_;
+
+      other.width_ = 0;
+      other.height_ = 0;
+      other.imageData_ = NULL;
+    }
+    return *this;
+  }
+
   bool PNG::operator==(PNG const & other) const {
     if (width_ != other.width_) { return false; }
     if (height_ != other.height_) { return false; }
 
-    for (unsigned i = 0; i < width_ * height_; i++) {
-      RGBAPixel & p1 = imageData_[i];
-      RGBAPixel & p2 = other.imageData_[i];
-      if (p1 != p2) { return false; }
+    // rows that are bit-for-bit equal are equal under the tolerant pixel
+    // comparison too, so only rows that differ are compared pixel by pixel
+    for (unsigned y = 0; y < height_; y++) {
+      const RGBAPixel * row1 = imageData_ + (std::size_t) y * width_;
+      const RGBAPixel * row2 = other.imageData_ + (std::size_t) y * width_;
+      if (memcmp(row1, row2, width_ * sizeof(RGBAPixel)) == 0) { continue; }
+      for (unsigned x = 0; x < width_; x++) {
+        if (row1[x] != row2[x]) { return false; }
+      }
     }
 
     return true;
@@ -98,79 +185,194 @@ namespace cs221util {
   }
 
   bool PNG::readFromFile(string const & fileName) {
-    vector<unsigned char> byteData;
-    unsigned error = lodepng::decode(byteData, width_, height_, fileName);
+#if defined(__unix__) || defined(__APPLE__)
+    // map the file and decode straight out of the page cache
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd >= 0) {
+      struct stat info;
+      if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        void * mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapped != MAP_FAILED) {
+          close(fd);
+          bool result = readFromMemory(static_cast<const unsigned char *>(mapped), info.st_size);
+          munmap(mapped, info.st_size);
+          return result;
+        }
+      }
+      close(fd);
+    }
+#endif
 
+    unsigned char * fileData = NULL;
+    size_t fileSize = 0;
+    unsigned error = lodepng_load_file(&fileData, &fileSize, fileName.c_str());
     if (error) {
+      free(fileData);
       cerr << "PNG decoder error " << error << ": " << lodepng_error_text(error) << endl;
       return false;
     }
+    bool result = readFromMemory(fileData, fileSize);
+    free(fileData);
+    return result;
+  }
 
-    delete[] imageData_;
-    imageData_ = new RGBAPixel[width_ * height_];
-
-    for (unsigned i = 0; i < byteData.size(); i += 4) {
-      RGBAPixel & pixel = imageData_[i/4];
-      pixel.r = byteData[i];
-      pixel.g = byteData[i + 1];
-      pixel.b = byteData[i + 2];
-      pixel.a = byteData[i + 3]/255.;
-
-    }
-/*
-    for (unsigned i = 0; i < byteData.size(); i += 4) {
-      rgbaColor rgb;
-      rgb.r = byteData[i];
-      rgb.g = byteData[i + 1];
-      rgb.b = byteData[i + 2];
-      rgb.a = byteData[i + 3];
+  bool PNG::readFromMemory(const unsigned char * data, std::size_t size) {
+#ifdef QTREE_STATS
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+#endif
+    unsigned char * byteData = NULL;
+    unsigned width = 0;
+    unsigned height = 0;
+    unsigned error = lodepng_decode32(&byteData, &width, &height, data, size);
+#ifdef QTREE_STATS
+    stats_.decodeSeconds += secondsSince(start);
+    stats_.bytesDecoded += size;
+#endif
 
-      hslaColor hsl = rgb2hsl(rgb);
-      RGBAPixel & pixel = imageData_[i/4];
-      pixel.h = hsl.h;
-      pixel.s = hsl.s;
-      pixel.l = hsl.l;
-      pixel.a = hsl.a;
+    if (error) {
+      free(byteData);
+      cerr << "PNG decoder error " << error << ": " << lodepng_error_text(error) << endl;
+      return false;
     }
-*/
 
+    // RGBAPixel has the same packed RGBA8 layout as the decoded bytes, so
+    // the decoder's buffer becomes the pixel buffer as is
+    _freePixels(imageData_);
+    width_ = width;
+    height_ = height;
+    imageData_ = reinterpret_cast<RGBAPixel *>(byteData);
     return true;
   }
 
   bool PNG::writeToFile(string const & fileName) {
-    unsigned char *byteData = new unsigned char[width_ * height_ * 4];
-/*
-    for (unsigned i = 0; i < width_ * height_; i++) {
-      hslaColor hsl;
-      hsl.h = imageData_[i].h;
-      hsl.s = imageData_[i].s;
-      hsl.l = imageData_[i].l;
-      hsl.a = imageData_[i].a;
+    return writeToFile(fileName, PNGEncodeOptions());
+  }
 
-      rgbaColor rgb = hsl2rgb(hsl);
+  bool PNG::writeToFile(string const & fileName, PNGEncodeOptions const & options) {
+#ifdef QTREE_STATS
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+#endif
+    unsigned char * encoded = NULL;
+    size_t encodedSize = 0;
+    unsigned error = _encode(&encoded, &encodedSize, options);
+    if (!error) {
+      error = lodepng_save_file(encoded, encodedSize, fileName.c_str());
+    }
+    free(encoded);
+#ifdef QTREE_STATS
+    stats_.encodeSeconds += secondsSince(start);
+    stats_.bytesEncoded += encodedSize;
+#endif
+    if (error) {
+      cerr << "PNG encoding error " << error << ": " << lodepng_error_text(error) << endl;
+    }
 
-      byteData[(i * 4)]     = rgb.r;
-      byteData[(i * 4) + 1] = rgb.g;
-      byteData[(i * 4) + 2] = rgb.b;
-      byteData[(i * 4) + 3] = rgb.a;
-    }*/
+    return (error == 0);
+  }
 
-    for (unsigned i = 0; i < width_ * height_; i++) {
-      byteData[(i * 4)]     = imageData_[i].r;
-      byteData[(i * 4) + 1] = imageData_[i].g;
-      byteData[(i * 4) + 2] = imageData_[i].b;
-      byteData[(i * 4) + 3] = imageData_[i].a * 255;
-    }
+  bool PNG::writeToMemory(vector<unsigned char> & out) const {
+    return writeToMemory(out, PNGEncodeOptions());
+  }
 
-    unsigned error = lodepng::encode(fileName, byteData, width_, height_);
+  bool PNG::writeToMemory(vector<unsigned char> & out, PNGEncodeOptions const & options) const {
+#ifdef QTREE_STATS
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+#endif
+    unsigned char * encoded = NULL;
+    size_t encodedSize = 0;
+    unsigned error = _encode(&encoded, &encodedSize, options);
+    if (!error) {
+      // lodepng has no way to encode into storage it did not allocate, so
+      // this is the one copy of the encoded bytes
+      out.insert(out.end(), encoded, encoded + encodedSize);
+    }
+    free(encoded);
+#ifdef QTREE_STATS
+    stats_.encodeSeconds += secondsSince(start);
+    stats_.bytesEncoded += encodedSize;
+#endif
     if (error) {
       cerr << "PNG encoding error " << error << ": " << lodepng_error_text(error) << endl;
     }
 
-    delete[] byteData;
     return (error == 0);
   }
 
+  /*
+   * Builds the palette of the distinct colors of count pixels and the
+   * index of every pixel into it, unless there are more than 256 colors.
+   * Runs of equal pixels, the bulk of a flat image, skip the lookup.
+   */
+  static bool indexColors(const RGBAPixel * pixels, std::size_t count,
+                          std::vector<RGBAPixel> & palette, std::vector<unsigned char> & indices) {
+    static const unsigned SLOTS = 1024; // power of two, well over 256 so probes stay short
+    uint32_t keys[SLOTS];
+    unsigned char values[SLOTS];
+    bool used[SLOTS] = { false };
+
+    indices.resize(count);
+    uint32_t last = 0;
+    unsigned char lastIndex = 0;
+    for (std::size_t i = 0; i < count; i++) {
+      uint32_t key;
+      memcpy(&key, &pixels[i], sizeof(key));
+      if (i == 0 || key != last) {
+        unsigned slot = (key * 2654435761u) >> 22;
+        while (used[slot] && keys[slot] != key) {
+          slot = (slot + 1) & (SLOTS - 1);
+        }
+        if (!used[slot]) {
+          if (palette.size() == 256) { return false; }
+          used[slot] = true;
+          keys[slot] = key;
+          values[slot] = palette.size();
+          palette.push_back(pixels[i]);
+        }
+        last = key;
+        lastIndex = values[slot];
+      }
+      indices[i] = lastIndex;
+    }
+
+    return !palette.empty();
+  }
+
+  unsigned PNG::_encode(unsigned char ** out, std::size_t * outSize, PNGEncodeOptions const & options) const {
+    lodepng::State state;
+    switch (options.filter) {
+      case PNGEncodeOptions::FILTER_NONE: state.encoder.filter_strategy = LFS_ZERO; break;
+      case PNGEncodeOptions::FILTER_MINSUM: state.encoder.filter_strategy = LFS_MINSUM; break;
+      case PNGEncodeOptions::FILTER_ENTROPY: state.encoder.filter_strategy = LFS_ENTROPY; break;
+    }
+    switch (options.level) {
+      case PNGEncodeOptions::LEVEL_STORE: state.encoder.zlibsettings.btype = 0; break;
+      case PNGEncodeOptions::LEVEL_FAST: state.encoder.zlibsettings.btype = 1; break;
+      case PNGEncodeOptions::LEVEL_DEFAULT: state.encoder.zlibsettings.btype = 2; break;
+    }
+    state.encoder.zlibsettings.windowsize = options.windowSize;
+    state.encoder.zlibsettings.lazymatching = options.lazyMatching;
+    state.encoder.auto_convert = options.autoConvert;
+
+    // RGBAPixel has the packed RGBA8 layout that lodepng encodes from
+    const unsigned char * data = reinterpret_cast<const unsigned char *>(imageData_);
+    std::vector<RGBAPixel> palette;
+    std::vector<unsigned char> indices;
+    if (options.palette && indexColors(imageData_, (std::size_t) width_ * height_, palette, indices)) {
+      // hand lodepng the indices in the same palette mode as the output,
+      // so it encodes them without any color conversion of its own
+      state.info_raw.colortype = LCT_PALETTE;
+      state.info_raw.bitdepth = 8;
+      for (std::size_t i = 0; i < palette.size(); i++) {
+        lodepng_palette_add(&state.info_raw, palette[i].r, palette[i].g, palette[i].b, palette[i].a);
+      }
+      lodepng_color_mode_copy(&state.info_png.color, &state.info_raw);
+      state.encoder.auto_convert = 0;
+      data = indices.data();
+    }
+
+    return lodepng_encode(out, outSize, data, width_, height_, &state);
+  }
+
   unsigned int PNG::width() const {
     return width_;
   }
@@ -180,46 +382,136 @@ namespace cs221util {
   }
 
   void PNG::resize(unsigned int newWidth, unsigned int newHeight) {
-    // Create a new vector to store the image data for the new (resized) image
-    RGBAPixel * newImageData = new RGBAPixel[newWidth * newHeight];
-
-    // Copy the current data to the new image data, using the existing pixel
-    // for coordinates within the bounds of the old image size
-    for (unsigned x = 0; x < newWidth; x++) {
-      for (unsigned y = 0; y < newHeight; y++) {
-        if (x < width_ && y < height_) {
-          RGBAPixel * oldPixel = this->getPixel(x, y);
-          RGBAPixel & newPixel = newImageData[ (x + (y * newWidth)) ];
-          newPixel = *oldPixel;
-        }
-      }
+    std::size_t oldCount = (std::size_t) width_ * height_;
+    std::size_t newCount = (std::size_t) newWidth * newHeight;
+    if (newCount == 0) {
+      _freePixels(imageData_);
+      imageData_ = NULL;
+      width_ = newWidth;
+      height_ = newHeight;
+      return;
     }
 
-    // Clear the existing image
-    delete[] imageData_;
+    // Pixels keep their coordinates, so the rows that are kept move within
+    // the buffer: grown before the move, shrunk after it. Narrower rows
+    // move towards the front, so they are moved first to last; wider rows
+    // move towards the back, so they are moved last to first.
+    if (newCount > oldCount) {
+      imageData_ = _reallocatePixels(imageData_, newCount);
+    }
+    unsigned rows = std::min(height_, newHeight);
+    std::size_t kept = std::min(width_, newWidth) * sizeof(RGBAPixel);
+    if (newWidth <= width_) {
+      for (unsigned y = 0; y < rows; y++) {
+        memmove(imageData_ + (std::size_t) y * newWidth, imageData_ + (std::size_t) y * width_, kept);
+      }
+    } else {
+      for (unsigned y = rows; y-- > 0; ) {
+        RGBAPixel * row = imageData_ + (std::size_t) y * newWidth;
+        memmove(row, imageData_ + (std::size_t) y * width_, kept);
+        std::uninitialized_fill(row + width_, row + newWidth, RGBAPixel());
+      }
+    }
+    std::uninitialized_fill(imageData_ + (std::size_t) rows * newWidth, imageData_ + newCount, RGBAPixel());
+    if (newCount < oldCount) {
+      imageData_ = _reallocatePixels(imageData_, newCount);
+    }
 
-    // Update the image to reflect the new image size and data
     width_ = newWidth;
     height_ = newHeight;
-    imageData_ = newImageData;
   }
 
-  std::size_t PNG::computeHash() const {
-    std::hash<float> hashFunction;
-    std::size_t hash = 0;
+  static const uint64_t HASH_PRIME1 = 11400714785074694791ULL;
+  static const uint64_t HASH_PRIME2 = 14029467366897019727ULL;
+  static const uint64_t HASH_PRIME3 = 1609587929392839161ULL;
+  static const uint64_t HASH_PRIME4 = 9650029242287828579ULL;
+  static const uint64_t HASH_PRIME5 = 2870177450012600261ULL;
+
+  static inline uint64_t hashRotate(uint64_t x, unsigned bits) {
+    return (x << bits) | (x >> (64 - bits));
+  }
 
+  static inline uint64_t hashLoad64(const unsigned char * p) {
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+  }
+
+  static inline uint64_t hashRound(uint64_t acc, uint64_t input) {
+    return hashRotate(acc + input * HASH_PRIME2, 31) * HASH_PRIME1;
+  }
+
+  static inline uint64_t hashMerge(uint64_t acc, uint64_t lane) {
+    return (acc ^ hashRound(0, lane)) * HASH_PRIME1 + HASH_PRIME4;
+  }
 
-    for (unsigned x = 0; x < this->width(); x++) {
-      for (unsigned y = 0; y < this->height(); y++) {
-        RGBAPixel * pixel = this->getPixel(x, y);
-        hash = (hash << 1) + hash + hashFunction(pixel->r);
-        hash = (hash << 1) + hash + hashFunction(pixel->g);
-        hash = (hash << 1) + hash + hashFunction(pixel->b);
-        hash = (hash << 1) + hash + hashFunction(pixel->a);
+  /*
+   * The xxHash64 algorithm: four independent lanes take 32 bytes per
+   * step, so the main loop runs at memory speed, and a final avalanche
+   * mixes the lanes and the tail.
+   */
+  static uint64_t hashBytes(const unsigned char * data, std::size_t size, uint64_t seed) {
+    const unsigned char * p = data;
+    const unsigned char * end = data + size;
+    uint64_t h;
+
+    if (size >= 32) {
+      uint64_t v1 = seed + HASH_PRIME1 + HASH_PRIME2;
+      uint64_t v2 = seed + HASH_PRIME2;
+      uint64_t v3 = seed;
+      uint64_t v4 = seed - HASH_PRIME1;
+      for (; p + 32 <= end; p += 32) {
+        v1 = hashRound(v1, hashLoad64(p));
+        v2 = hashRound(v2, hashLoad64(p + 8));
+        v3 = hashRound(v3, hashLoad64(p + 16));
+        v4 = hashRound(v4, hashLoad64(p + 24));
       }
+      h = hashRotate(v1, 1) + hashRotate(v2, 7) + hashRotate(v3, 12) + hashRotate(v4, 18);
+      h = hashMerge(h, v1);
+      h = hashMerge(h, v2);
+      h = hashMerge(h, v3);
+      h = hashMerge(h, v4);
+    } else {
+      h = seed + HASH_PRIME5;
     }
+    h += size;
+
+    for (; p + 8 <= end; p += 8) {
+      h = hashRotate(h ^ hashRound(0, hashLoad64(p)), 27) * HASH_PRIME1 + HASH_PRIME4;
+    }
+    if (p + 4 <= end) {
+      uint32_t k;
+      memcpy(&k, p, sizeof(k));
+      h = hashRotate(h ^ (k * HASH_PRIME1), 23) * HASH_PRIME2 + HASH_PRIME3;
+      p += 4;
+    }
+    for (; p < end; p++) {
+      h = hashRotate(h ^ (*p * HASH_PRIME5), 11) * HASH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+    return h;
+  }
+
+  std::size_t PNG::computeHash() const {
+    // pixels are packed RGBA8 and stored row-major in one buffer, so the
+    // whole image is hashed in a single pass over it; the dimensions seed
+    // the hash so that images of the same pixels in other shapes differ
+    uint64_t seed = ((uint64_t) width_ << 32) | height_;
+    const unsigned char * bytes = reinterpret_cast<const unsigned char *>(imageData_);
+    return (std::size_t) hashBytes(bytes, (std::size_t) width_ * height_ * sizeof(RGBAPixel), seed);
+  }
+
+  PNGStats const & PNG::stats() const {
+    return stats_;
+  }
 
-    return hash;
+  void PNG::resetStats() {
+    stats_ = PNGStats();
   }
 
   std::ostream & operator << ( std::ostream& os, PNG const& png ) {
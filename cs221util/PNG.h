@@ -8,6 +8,9 @@
 #ifndef CS221_PNG_H_
 #define CS221_PNG_H_
 
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 //#include "HSLAPixel.h"
@@ -16,6 +19,56 @@
 using namespace std;
 
 namespace cs221util {
+  /**
+   * Encoding and decoding counters of one PNG object. They are only kept
+   * when compiled with QTREE_STATS defined, and are all zero otherwise.
+   */
+  struct PNGStats {
+    PNGStats();
+
+    uint64_t bytesDecoded;   /*< Encoded bytes read by readFromFile/readFromMemory */
+    uint64_t bytesEncoded;   /*< Encoded bytes produced by writeToFile/writeToMemory */
+    double decodeSeconds;    /*< Time spent decoding */
+    double encodeSeconds;    /*< Time spent encoding, and writing files */
+  };
+
+  /**
+   * Encoder settings for writeToFile and writeToMemory. The defaults are
+   * lodepng's, which compress well but spend most of their time searching
+   * for matches; images of large flat areas, like rendered quadtrees,
+   * compress nearly as well with much cheaper settings.
+   */
+  struct PNGEncodeOptions {
+    PNGEncodeOptions();
+
+    /**
+     * How each row is filtered before compression.
+     */
+    enum Filter {
+      FILTER_NONE,    /*< no filtering, the cheapest */
+      FILTER_MINSUM,  /*< per row, the filter with the smallest sum of residues */
+      FILTER_ENTROPY  /*< per row, the filter with the smallest entropy of residues */
+    };
+
+    /**
+     * How the filtered rows are deflated.
+     */
+    enum Level {
+      LEVEL_STORE,    /*< stored uncompressed, only framed as deflate blocks */
+      LEVEL_FAST,     /*< compressed with the fixed Huffman codes of deflate */
+      LEVEL_DEFAULT   /*< compressed with Huffman codes fit to the data */
+    };
+
+    Filter filter;            /*< Row filter; default FILTER_MINSUM */
+    Level level;              /*< Deflate block type; default LEVEL_DEFAULT */
+    unsigned windowSize;      /*< Match search window, a power of two up to 32768; default 2048 */
+    bool lazyMatching;        /*< Look one byte ahead for a longer match; default true */
+    bool autoConvert;         /*< Scan the image for the smallest color type that holds it
+                                  exactly; if false, RGBA is written as is. Default true */
+    bool palette;             /*< Write an indexed image when there are at most 256 distinct
+                                  colors; default false */
+  };
+
   class PNG {
   public:
     /**
@@ -37,6 +90,15 @@ namespace cs221util {
       */
     PNG(PNG const & other);
 
+    /**
+      * Move constructor: takes over the pixel buffer of another PNG
+      * without copying it. The other image is left empty. Never throws,
+      * so containers of PNGs move them rather than copy them when they
+      * grow.
+      * @param other PNG to be moved from.
+      */
+    PNG(PNG && other) noexcept;
+
     /**
       * Destructor: frees all memory associated with a given PNG object.
       * Invoked by the system.
@@ -51,7 +113,18 @@ namespace cs221util {
     PNG const & operator= (PNG const & other);
 
     /**
-      * Equality operator: checks if two images are the same.
+      * Move assignment operator: frees the current image and takes over
+      * the pixel buffer of another PNG without copying it. The other
+      * image is left empty.
+      * @param other Image to move into the current image.
+      * @return The current image for assignment chaining.
+      */
+    PNG & operator= (PNG && other) noexcept;
+
+    /**
+      * Equality operator: checks if two images are the same, allowing
+      * the small per-pixel deviations of RGBAPixel::operator==. Rows that
+      * are bit-for-bit identical are compared with a single memcmp.
       * @param other Image to be checked.
       * @return Whether the current image is equal to the other image.
       */
@@ -73,6 +146,17 @@ namespace cs221util {
       */
     bool readFromFile(string const & fileName);
 
+    /**
+      * Reads in a PNG image from an encoded PNG held in memory, such as
+      * a file mapped with mmap. The image adopts the decoder's output
+      * buffer, so the pixels are neither copied nor repacked.
+      * Overwrites any current image content in the PNG.
+      * @param data First byte of the encoded PNG.
+      * @param size Number of bytes of encoded PNG.
+      * @return true, if the image was successfully decoded and loaded.
+      */
+    bool readFromMemory(const unsigned char * data, std::size_t size);
+
     /**
       * Writes a PNG image to a file.
       * @param fileName Name of the file to be written.
@@ -80,6 +164,35 @@ namespace cs221util {
       */
     bool writeToFile(string const & fileName);
 
+    /**
+      * Writes a PNG image to a file with the given encoder settings.
+      * @param fileName Name of the file to be written.
+      * @param options Encoder settings.
+      * @return true, if the image was successfully written.
+      */
+    bool writeToFile(string const & fileName, PNGEncodeOptions const & options);
+
+    /**
+      * Encodes the image as a PNG in memory, encoding straight from the
+      * pixel buffer, without converting the pixels first. lodepng always
+      * encodes into an output buffer it allocates itself, so the encoded
+      * bytes are then copied once into out and that buffer is freed.
+      * @param out Vector the encoded bytes are appended to; reusing one
+      * vector across calls reuses its storage for the copy.
+      * @return true, if the image was successfully encoded.
+      */
+    bool writeToMemory(vector<unsigned char> & out) const;
+
+    /**
+      * Encodes the image as a PNG in memory with the given encoder
+      * settings. As with writeToMemory(out), the encoded bytes are copied
+      * once from lodepng's own output buffer into out.
+      * @param out Vector the encoded bytes are appended to.
+      * @param options Encoder settings.
+      * @return true, if the image was successfully encoded.
+      */
+    bool writeToMemory(vector<unsigned char> & out, PNGEncodeOptions const & options) const;
+
     /**
       * Pixel access operator. Gets a pointer to the pixel at the given
       * coordinates in the image. (0,0) is the upper left corner.
@@ -90,6 +203,25 @@ namespace cs221util {
       */
     RGBAPixel * getPixel(unsigned int x, unsigned int y) const;
 
+    /**
+      * Unchecked pixel access operator. Returns the pixel at the given
+      * coordinates without the bounds checks of getPixel; coordinates
+      * are only checked by assertions in debug builds.
+      * @param x X-coordinate of the pixel, less than width().
+      * @param y Y-coordinate of the pixel, less than height().
+      * @return A reference to the pixel at the given coordinates.
+      */
+    RGBAPixel & operator()(unsigned int x, unsigned int y) const;
+
+    /**
+      * Gets a pointer to the first pixel of row y. Pixels are stored
+      * row-major, so the row's width() pixels are contiguous and
+      * row y + 1 starts right after it. Unchecked, like operator().
+      * @param y Y-coordinate of the row, less than height().
+      * @return A pointer to the leftmost pixel of the row.
+      */
+    RGBAPixel * getRow(unsigned int y) const;
+
     /**
       * Gets the width of this image.
       * @return Width of the image.
@@ -105,22 +237,59 @@ namespace cs221util {
     /**
       * Resizes the image to the given coordinates. Attempts to preserve
       * existing pixel data in the image when doing so, but will crop if
-      * necessary. No pixel interpolation is done.
+      * necessary. No pixel interpolation is done. The pixel buffer is
+      * reused: rows are moved within it, and only new pixels are written.
       * @param newWidth New width of the image.
       * @param newHeight New height of the image.
       */
     void resize(unsigned int newWidth, unsigned int newHeight);
 
     /**
-     * Computes a hash of the contents of the image.
+     * Computes a hash of the contents of the image: xxHash64 of the
+     * packed pixel buffer, seeded with the dimensions.
      */
     std::size_t computeHash() const;
 
+    /**
+     * Gets the encoding and decoding counters of this image, kept since
+     * it was constructed or resetStats was called.
+     * @return The counters; all zero unless compiled with QTREE_STATS.
+     */
+    PNGStats const & stats() const;
+
+    /**
+     * Sets the counters of stats() back to zero.
+     */
+    void resetStats();
+
   private:
     unsigned int width_;            /*< Width of the image */
     unsigned int height_;           /*< Height of the image */
     RGBAPixel *imageData_;          /*< Array of pixels */
     RGBAPixel defaultPixel_;        /*< Default pixel, returned in cases of errors */
+    mutable PNGStats stats_;        /*< I/O counters, only updated with QTREE_STATS */
+
+    /**
+     * Allocates count default pixels in a buffer that _freePixels frees.
+     */
+    static RGBAPixel * _allocatePixels(std::size_t count);
+
+    /**
+     * Resizes a buffer from _allocatePixels to count pixels, keeping the
+     * first ones; new pixels are left unconstructed.
+     */
+    static RGBAPixel * _reallocatePixels(RGBAPixel * pixels, std::size_t count);
+
+    /**
+     * Frees a pixel buffer from _allocatePixels or from the PNG decoder.
+     */
+    static void _freePixels(RGBAPixel * pixels);
+
+    /**
+     * Encodes the image into a buffer that the caller frees with free().
+     * @return The lodepng error code, 0 on success.
+     */
+    unsigned _encode(unsigned char ** out, std::size_t * outSize, PNGEncodeOptions const & options) const;
 
     /**
      * Copeies the contents of `other` to self
@@ -128,6 +297,16 @@ namespace cs221util {
      void _copy(PNG const & other);
   };
 
+  inline RGBAPixel & PNG::operator()(unsigned int x, unsigned int y) const {
+    assert(x < width_ && y < height_);
+    return imageData_[x + (y * width_)];
+  }
+
+  inline RGBAPixel * PNG::getRow(unsigned int y) const {
+    assert(y < height_);
+    return imageData_ + (y * width_);
+  }
+
   std::ostream & operator<<(std::ostream & out, PNG const & pixel);
   std::stringstream & operator<<(std::stringstream & out, PNG const & pixel);
 }
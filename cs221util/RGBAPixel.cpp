@@ -9,6 +9,11 @@
 #include "RGBAPixel.h"
 #include <cmath>
 #include <iostream>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 using namespace std;
 
 namespace cs221util {
@@ -16,35 +21,34 @@ namespace cs221util {
     r = 0;
     g = 0;
     b = 0;
-    a = 1.0;
-  }
-
-  RGBAPixel::RGBAPixel(const RGBAPixel& other) {
-      r = other.r;
-      g = other.g;
-      b = other.b;
-      a = other.a;
+    a = 255;
   }
 
   RGBAPixel::RGBAPixel(int red, int green, int blue){
     r = red;
     g = green;
     b = blue;
-    a = 1.0;
+    a = 255;
   }
   RGBAPixel::RGBAPixel(int red, int green, int blue, double alpha){
     r = red;
     g = green;
     b = blue;
-    a = alpha;
+    setAlpha(alpha);
   }
 
-  RGBAPixel & RGBAPixel::operator=(RGBAPixel const & other) {
-    this->r = other.r;
-    this->g = other.g;
-    this->b = other.b;
-    this->a = other.a;
-    return *this;
+  double RGBAPixel::alpha() const {
+    return a / 255.;
+  }
+
+  void RGBAPixel::setAlpha(double alpha) {
+    if (alpha <= 0) {
+      a = 0;
+    } else if (alpha >= 1) {
+      a = 255;
+    } else {
+      a = (unsigned char) lround(alpha * 255);
+    }
   }
 
   bool RGBAPixel::operator== (RGBAPixel const & other) const {
@@ -52,7 +56,7 @@ namespace cs221util {
     // adapted by cinda to allow for slight deviations in RGB
 
     if ( a == 0 ) { return true; }
-    if (fabs(a - other.a) > 0.01) { return false; }
+    if (fabs(alpha() - other.alpha()) > 0.01) { return false; }
 
     if (fabs(r - other.r) > 2) { return false; } 
     if (fabs(g - other.g) > 2) { return false; } 
@@ -88,20 +92,22 @@ namespace cs221util {
    */
   double RGBAPixel::distanceTo(RGBAPixel other) {
       // this pixel's color channels
-      double r_this = (r / 255.0) * a;
-      double g_this = (g / 255.0) * a;
-      double b_this = (b / 255.0) * a;
+      double a_this = alpha();
+      double r_this = (r / 255.0) * a_this;
+      double g_this = (g / 255.0) * a_this;
+      double b_this = (b / 255.0) * a_this;
 
       // other pixel's color channels
-      double r_other = (other.r / 255.0) * other.a;
-      double g_other = (other.g / 255.0) * other.a;
-      double b_other = (other.b / 255.0) * other.a;
+      double a_other = other.alpha();
+      double r_other = (other.r / 255.0) * a_other;
+      double g_other = (other.g / 255.0) * a_other;
+      double b_other = (other.b / 255.0) * a_other;
 
       double r_diff = r_other - r_this;
       double g_diff = g_other - g_this;
       double b_diff = b_other - b_this;
 
-      double alphadiff = other.a - a;
+      double alphadiff = a_other - a_this;
 
       double maxdiff_r = max(r_diff * r_diff, (r_diff - alphadiff) * (r_diff - alphadiff));
       double maxdiff_g = max(g_diff * g_diff, (g_diff - alphadiff) * (g_diff - alphadiff));
@@ -110,8 +116,193 @@ namespace cs221util {
       return maxdiff_r + maxdiff_g + maxdiff_b;
   }
 
+  /*
+   * Batched distance kernels. Each computes exactly the operations of
+   * distanceTo, in the same order, for several pixels at once (the
+   * kernels use no fused multiply-add), so results are bit-identical.
+   */
+  namespace {
+    typedef void (*DistanceKernel)(RGBAPixel const & ref, RGBAPixel const * pixels, std::size_t n, double * out);
+
+    void distancesScalar(RGBAPixel const & ref, RGBAPixel const * pixels, std::size_t n, double * out) {
+      for (std::size_t i = 0; i < n; i++) {
+        RGBAPixel pixel = pixels[i];
+        out[i] = pixel.distanceTo(ref);
+      }
+    }
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    __attribute__((target("avx2")))
+    void distancesAVX2(RGBAPixel const & ref, RGBAPixel const * pixels, std::size_t n, double * out) {
+      const double a_ref = ref.alpha();
+      const __m256d r_other = _mm256_set1_pd((ref.r / 255.0) * a_ref);
+      const __m256d g_other = _mm256_set1_pd((ref.g / 255.0) * a_ref);
+      const __m256d b_other = _mm256_set1_pd((ref.b / 255.0) * a_ref);
+      const __m256d a_other = _mm256_set1_pd(a_ref);
+      const __m256d k255 = _mm256_set1_pd(255.0);
+
+      // gather one channel of four packed RGBA8 pixels into the low four bytes
+      const __m128i pick_r = _mm_setr_epi8(0, 4, 8, 12, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+      const __m128i pick_g = _mm_setr_epi8(1, 5, 9, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+      const __m128i pick_b = _mm_setr_epi8(2, 6, 10, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+      const __m128i pick_a = _mm_setr_epi8(3, 7, 11, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+
+      std::size_t i = 0;
+      for (; i + 4 <= n; i += 4) {
+        __m128i px = _mm_loadu_si128(reinterpret_cast<const __m128i *>(pixels + i));
+        __m256d a_this = _mm256_div_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_shuffle_epi8(px, pick_a))), k255);
+        __m256d r_this = _mm256_mul_pd(_mm256_div_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_shuffle_epi8(px, pick_r))), k255), a_this);
+        __m256d g_this = _mm256_mul_pd(_mm256_div_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_shuffle_epi8(px, pick_g))), k255), a_this);
+        __m256d b_this = _mm256_mul_pd(_mm256_div_pd(_mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_shuffle_epi8(px, pick_b))), k255), a_this);
+
+        __m256d alphadiff = _mm256_sub_pd(a_other, a_this);
+        __m256d r_diff = _mm256_sub_pd(r_other, r_this);
+        __m256d g_diff = _mm256_sub_pd(g_other, g_this);
+        __m256d b_diff = _mm256_sub_pd(b_other, b_this);
+        __m256d r_alpha = _mm256_sub_pd(r_diff, alphadiff);
+        __m256d g_alpha = _mm256_sub_pd(g_diff, alphadiff);
+        __m256d b_alpha = _mm256_sub_pd(b_diff, alphadiff);
+
+        __m256d maxdiff_r = _mm256_max_pd(_mm256_mul_pd(r_diff, r_diff), _mm256_mul_pd(r_alpha, r_alpha));
+        __m256d maxdiff_g = _mm256_max_pd(_mm256_mul_pd(g_diff, g_diff), _mm256_mul_pd(g_alpha, g_alpha));
+        __m256d maxdiff_b = _mm256_max_pd(_mm256_mul_pd(b_diff, b_diff), _mm256_mul_pd(b_alpha, b_alpha));
+
+        _mm256_storeu_pd(out + i, _mm256_add_pd(_mm256_add_pd(maxdiff_r, maxdiff_g), maxdiff_b));
+      }
+      distancesScalar(ref, pixels + i, n - i, out + i);
+    }
+#endif
+
+#if defined(__SSE2__)
+    void distancesSSE2(RGBAPixel const & ref, RGBAPixel const * pixels, std::size_t n, double * out) {
+      const double a_ref = ref.alpha();
+      const __m128d r_other = _mm_set1_pd((ref.r / 255.0) * a_ref);
+      const __m128d g_other = _mm_set1_pd((ref.g / 255.0) * a_ref);
+      const __m128d b_other = _mm_set1_pd((ref.b / 255.0) * a_ref);
+      const __m128d a_other = _mm_set1_pd(a_ref);
+      const __m128d k255 = _mm_set1_pd(255.0);
+
+      std::size_t i = 0;
+      for (; i + 2 <= n; i += 2) {
+        RGBAPixel const & p0 = pixels[i];
+        RGBAPixel const & p1 = pixels[i + 1];
+        __m128d a_this = _mm_div_pd(_mm_set_pd(p1.a, p0.a), k255);
+        __m128d r_this = _mm_mul_pd(_mm_div_pd(_mm_set_pd(p1.r, p0.r), k255), a_this);
+        __m128d g_this = _mm_mul_pd(_mm_div_pd(_mm_set_pd(p1.g, p0.g), k255), a_this);
+        __m128d b_this = _mm_mul_pd(_mm_div_pd(_mm_set_pd(p1.b, p0.b), k255), a_this);
+
+        __m128d alphadiff = _mm_sub_pd(a_other, a_this);
+        __m128d r_diff = _mm_sub_pd(r_other, r_this);
+        __m128d g_diff = _mm_sub_pd(g_other, g_this);
+        __m128d b_diff = _mm_sub_pd(b_other, b_this);
+        __m128d r_alpha = _mm_sub_pd(r_diff, alphadiff);
+        __m128d g_alpha = _mm_sub_pd(g_diff, alphadiff);
+        __m128d b_alpha = _mm_sub_pd(b_diff, alphadiff);
+
+        __m128d maxdiff_r = _mm_max_pd(_mm_mul_pd(r_diff, r_diff), _mm_mul_pd(r_alpha, r_alpha));
+        __m128d maxdiff_g = _mm_max_pd(_mm_mul_pd(g_diff, g_diff), _mm_mul_pd(g_alpha, g_alpha));
+        __m128d maxdiff_b = _mm_max_pd(_mm_mul_pd(b_diff, b_diff), _mm_mul_pd(b_alpha, b_alpha));
+
+        _mm_storeu_pd(out + i, _mm_add_pd(_mm_add_pd(maxdiff_r, maxdiff_g), maxdiff_b));
+      }
+      distancesScalar(ref, pixels + i, n - i, out + i);
+    }
+#endif
+
+#if defined(__aarch64__)
+    void distancesNEON(RGBAPixel const & ref, RGBAPixel const * pixels, std::size_t n, double * out) {
+      const double a_ref = ref.alpha();
+      const float64x2_t r_other = vdupq_n_f64((ref.r / 255.0) * a_ref);
+      const float64x2_t g_other = vdupq_n_f64((ref.g / 255.0) * a_ref);
+      const float64x2_t b_other = vdupq_n_f64((ref.b / 255.0) * a_ref);
+      const float64x2_t a_other = vdupq_n_f64(a_ref);
+      const float64x2_t k255 = vdupq_n_f64(255.0);
+
+      std::size_t i = 0;
+      for (; i + 2 <= n; i += 2) {
+        RGBAPixel const & p0 = pixels[i];
+        RGBAPixel const & p1 = pixels[i + 1];
+        const double a_in[2] = { (double) p0.a, (double) p1.a };
+        const double r_in[2] = { (double) p0.r, (double) p1.r };
+        const double g_in[2] = { (double) p0.g, (double) p1.g };
+        const double b_in[2] = { (double) p0.b, (double) p1.b };
+        float64x2_t a_this = vdivq_f64(vld1q_f64(a_in), k255);
+        float64x2_t r_this = vmulq_f64(vdivq_f64(vld1q_f64(r_in), k255), a_this);
+        float64x2_t g_this = vmulq_f64(vdivq_f64(vld1q_f64(g_in), k255), a_this);
+        float64x2_t b_this = vmulq_f64(vdivq_f64(vld1q_f64(b_in), k255), a_this);
+
+        float64x2_t alphadiff = vsubq_f64(a_other, a_this);
+        float64x2_t r_diff = vsubq_f64(r_other, r_this);
+        float64x2_t g_diff = vsubq_f64(g_other, g_this);
+        float64x2_t b_diff = vsubq_f64(b_other, b_this);
+        float64x2_t r_alpha = vsubq_f64(r_diff, alphadiff);
+        float64x2_t g_alpha = vsubq_f64(g_diff, alphadiff);
+        float64x2_t b_alpha = vsubq_f64(b_diff, alphadiff);
+
+        float64x2_t maxdiff_r = vmaxq_f64(vmulq_f64(r_diff, r_diff), vmulq_f64(r_alpha, r_alpha));
+        float64x2_t maxdiff_g = vmaxq_f64(vmulq_f64(g_diff, g_diff), vmulq_f64(g_alpha, g_alpha));
+        float64x2_t maxdiff_b = vmaxq_f64(vmulq_f64(b_diff, b_diff), vmulq_f64(b_alpha, b_alpha));
+
+        vst1q_f64(out + i, vaddq_f64(vaddq_f64(maxdiff_r, maxdiff_g), maxdiff_b));
+      }
+      distancesScalar(ref, pixels + i, n - i, out + i);
+    }
+#endif
+
+    struct KernelChoice {
+      DistanceKernel kernel;
+      const char * name;
+    };
+
+    KernelChoice chooseKernel() {
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+      __builtin_cpu_init();
+      if (__builtin_cpu_supports("avx2")) {
+        return KernelChoice{ distancesAVX2, "avx2" };
+      }
+#endif
+#if defined(__SSE2__)
+      return KernelChoice{ distancesSSE2, "sse2" };
+#elif defined(__aarch64__)
+      return KernelChoice{ distancesNEON, "neon" };
+#else
+      return KernelChoice{ distancesScalar, "scalar" };
+#endif
+    }
+
+    KernelChoice const & kernel() {
+      static const KernelChoice choice = chooseKernel();
+      return choice;
+    }
+  }
+
+  void distancesTo(RGBAPixel const & ref, RGBAPixel const * pixels, std::size_t n, double * out) {
+    kernel().kernel(ref, pixels, n, out);
+  }
+
+  bool allWithinDistance(RGBAPixel const & ref, RGBAPixel const * pixels, std::size_t n, double tolerance) {
+    const std::size_t BLOCK = 64;
+    double distances[BLOCK];
+    DistanceKernel compute = kernel().kernel;
+
+    for (std::size_t i = 0; i < n; i += BLOCK) {
+      std::size_t count = (n - i < BLOCK) ? n - i : BLOCK;
+      compute(ref, pixels + i, count, distances);
+      for (std::size_t j = 0; j < count; j++) {
+        if (distances[j] > tolerance) {
+          return false;
+        }
+      }
+    }
+    return true;
+  }
+
+  const char * distanceKernelName() {
+    return kernel().name;
+  }
+
   std::ostream & operator<<(std::ostream & out, RGBAPixel const & pixel) {
-    out << "(" << pixel.r << ", " << pixel.g << ", " << pixel.b << (pixel.a != 1 ? ", " + std::to_string(pixel.a) : "") << ")";
+    out << "(" << pixel.r << ", " << pixel.g << ", " << pixel.b << (pixel.a != 255 ? ", " + std::to_string(pixel.alpha()) : "") << ")";
 
     return out;
   }
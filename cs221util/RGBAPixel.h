@@ -8,6 +8,7 @@
 #ifndef CS221_RGBAPIXEL_H_
 #define CS221_RGBAPIXEL_H_
 
+#include <cstddef>
 #include <iostream>
 #include <sstream>
 
@@ -17,7 +18,7 @@ namespace cs221util {
     unsigned char r; /**< red component of pixel, [0,255] */
     unsigned char g; /**< green component of pixel, [0,255] . */
     unsigned char b; /**< blue component of pixel, [0,255] . */
-    double a; /**< Alpha of the pixel, [0, 1]. */
+    unsigned char a; /**< alpha component of pixel, [0,255]; 255 is opaque. See alpha(). */
 
     /**
      * Constructs a default RGBAPixel.
@@ -31,7 +32,7 @@ namespace cs221util {
     /**
      * Constructs a RGBAPixel as a copy of another.
      */
-    RGBAPixel(const RGBAPixel& other);
+    RGBAPixel(const RGBAPixel& other) = default;
 
     /**
      * Constructs an opaque RGBAPixel with the given red, green,
@@ -50,11 +51,23 @@ namespace cs221util {
      * @param red value for the new pixel, in [0, 255].
      * @param green value for the new pixel, [0, 255].
      * @param blue value for the new pixel, [0, 255].
-     * @param alpha Alpha value for the new pixel, [0, 1].
+     * @param alpha Alpha value for the new pixel, [0, 1]. It is stored
+     * as the nearest of 256 levels, as in a PNG file.
      */
     RGBAPixel(int red, int green, int blue, double alpha);
 
-    RGBAPixel & operator=(RGBAPixel const & other);
+    /**
+     * Alpha of the pixel as a fraction in [0, 1].
+     */
+    double alpha() const;
+
+    /**
+     * Sets the alpha of the pixel from a fraction in [0, 1], rounded to
+     * the nearest of 256 levels.
+     */
+    void setAlpha(double alpha);
+
+    RGBAPixel & operator=(RGBAPixel const & other) = default;
     bool operator== (RGBAPixel const & other) const ;
     bool operator!= (RGBAPixel const & other) const ;
     bool operator<  (RGBAPixel const & other) const ;
@@ -67,6 +80,42 @@ namespace cs221util {
     double distanceTo(RGBAPixel other);
   };
 
+  static_assert(sizeof(RGBAPixel) == 4, "RGBAPixel is packed RGBA8");
+
+  /**
+   * Computes the RGBA color distance between a reference pixel and each
+   * pixel of a contiguous run: out[i] = pixels[i].distanceTo(ref).
+   * The results are bit-identical to distanceTo. Runs are processed
+   * several pixels at a time with the widest SIMD kernel the CPU
+   * supports (AVX2 or SSE2 on x86, NEON on ARM), chosen at runtime, with
+   * a scalar fallback.
+   *
+   * @param ref the pixel to measure distances to
+   * @param pixels the first of n pixels
+   * @param n number of pixels
+   * @param out receives the n distances
+   */
+  void distancesTo(RGBAPixel const & ref, RGBAPixel const * pixels, std::size_t n, double * out);
+
+  /**
+   * Returns true if every pixel of a contiguous run is within tolerance
+   * of a reference pixel, i.e. pixels[i].distanceTo(ref) <= tolerance
+   * for all i. Stops at the first block of pixels that contains one
+   * that is not.
+   *
+   * @param ref the pixel to measure distances to
+   * @param pixels the first of n pixels
+   * @param n number of pixels
+   * @param tolerance maximum distance allowed
+   */
+  bool allWithinDistance(RGBAPixel const & ref, RGBAPixel const * pixels, std::size_t n, double tolerance);
+
+  /**
+   * Name of the kernel used by distancesTo on this CPU ("avx2", "sse2",
+   * "neon" or "scalar").
+   */
+  const char * distanceKernelName();
+
   /**
    * Stream operator that allows pixels to be written to standard streams
    * (like cout).
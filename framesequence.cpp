@@ -0,0 +1,80 @@
+#include "framesequence.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <vector>
+
+FrameSequence::FrameSequence(unsigned int tileSize)
+	: tileSize(tileSize), changedTiles(0), tiles(0) {
+	assert(tileSize > 0);
+}
+
+/**
+ * Compares frame with the last frame one band of tiles at a time. Each
+ * row of the band is compared tile by tile, skipping tiles already known
+ * to differ; every run of adjacent changed tiles is then handed to
+ * QTree::Update as one rectangle and copied into the kept frame.
+ */
+const QTree& FrameSequence::Next(const PNG& frame) {
+	unsigned int width = frame.width();
+	unsigned int height = frame.height();
+	unsigned int tilesX = (width + tileSize - 1) / tileSize;
+	unsigned int tilesY = (height + tileSize - 1) / tileSize;
+	tiles = tilesX * tilesY;
+
+	if (tree == nullptr || width != previous.width() || height != previous.height()) {
+		tree.reset(new QTree(frame));
+		previous = frame;
+		changedTiles = tiles;
+		return *tree;
+	}
+
+	changedTiles = 0;
+	vector<bool> changed(tilesX);
+	for (unsigned int ty = 0; ty < tilesY; ty++) {
+		unsigned int y0 = ty * tileSize;
+		unsigned int y1 = min(height, y0 + tileSize) - 1;
+
+		fill(changed.begin(), changed.end(), false);
+		for (unsigned int y = y0; y <= y1; y++) {
+			const RGBAPixel* now = frame.getRow(y);
+			const RGBAPixel* before = previous.getRow(y);
+			for (unsigned int tx = 0; tx < tilesX; tx++) {
+				if (changed[tx]) {
+					continue;
+				}
+				unsigned int x0 = tx * tileSize;
+				unsigned int x1 = min(width, x0 + tileSize);
+				changed[tx] = memcmp(now + x0, before + x0, (x1 - x0) * sizeof(RGBAPixel)) != 0;
+			}
+		}
+
+		for (unsigned int tx = 0; tx < tilesX; ) {
+			if (!changed[tx]) {
+				tx++;
+				continue;
+			}
+			unsigned int first = tx;
+			while (tx < tilesX && changed[tx]) {
+				tx++;
+			}
+			changedTiles += tx - first;
+
+			unsigned int x0 = first * tileSize;
+			unsigned int x1 = min(width, tx * tileSize) - 1;
+			tree->Update(frame, make_pair(x0, y0), make_pair(x1, y1));
+			for (unsigned int y = y0; y <= y1; y++) {
+				memcpy(previous.getRow(y) + x0, frame.getRow(y) + x0, (x1 - x0 + 1) * sizeof(RGBAPixel));
+			}
+		}
+	}
+	return *tree;
+}
+
+unsigned int FrameSequence::ChangedTiles() const {
+	return changedTiles;
+}
+
+unsigned int FrameSequence::Tiles() const {
+	return tiles;
+}
@@ -0,0 +1,61 @@
+#ifndef _FRAMESEQUENCE_H_
+#define _FRAMESEQUENCE_H_
+
+#include <memory>
+#include "cs221util/PNG.h"
+#include "qtree.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * FrameSequence builds the trees of a sequence of frames, such as a screen
+ * recording, where most of each frame is the same as the one before.
+ * It keeps the last frame and its tree. Each new frame is compared with
+ * the last one in square tiles, row by row with memcmp, and only the runs
+ * of tiles that changed are rebuilt into the tree with QTree::Update; the
+ * rest of the tree is reused as it is. The tree is identical to
+ * QTree(frame), so the cost of a frame is one pass over its pixels at
+ * memory speed plus a rebuild proportional to what changed.
+ *
+ * The tree returned by Next changes with the next frame; copy it (which
+ * shares its nodes, see QTree(const QTree&)) to keep it, or to prune,
+ * flip or rotate it.
+ */
+class FrameSequence {
+public:
+    /**
+     * Starts an empty sequence comparing frames in tiles of tileSize by
+     * tileSize pixels.
+     * @pre tileSize > 0
+     */
+    FrameSequence(unsigned int tileSize);
+
+    /**
+     * Makes frame the current frame and returns its tree. The first frame,
+     * and any frame of other dimensions than the last, is built from
+     * scratch.
+     */
+    const QTree& Next(const PNG& frame);
+
+    /**
+     * Number of tiles of the current frame that differed from the frame
+     * before and were rebuilt; every tile, if the frame was built from
+     * scratch.
+     */
+    unsigned int ChangedTiles() const;
+
+    /**
+     * Number of tiles in the current frame.
+     */
+    unsigned int Tiles() const;
+
+private:
+    unsigned int tileSize;
+    PNG previous;              // the current frame, compared with the next one
+    unique_ptr<QTree> tree;    // tree of previous, or nullptr before the first frame
+    unsigned int changedTiles;
+    unsigned int tiles;
+};
+
+#endif
@@ -0,0 +1,64 @@
+#include "integralimage.h"
+
+/**
+ * Builds the summed-area table of img. Entry (x, y) holds the sums over
+ * the pixels left of column x and above row y, so the table has an extra
+ * row and column of zeros and needs no bounds checks when queried.
+ */
+IntegralImage::IntegralImage(const PNG& img) {
+	width = img.width();
+	height = img.height();
+	sums.resize((size_t) (width + 1) * (height + 1), Sums{ 0, 0, 0, 0 });
+
+	for (unsigned int y = 0; y < height; y++) {
+		const RGBAPixel* row = img.getRow(y);
+		const Sums* above = &sums[(size_t) y * (width + 1)];
+		Sums* current = &sums[(size_t) (y + 1) * (width + 1)];
+
+		Sums line = { 0, 0, 0, 0 };
+		for (unsigned int x = 0; x < width; x++) {
+			line.r += row[x].r;
+			line.g += row[x].g;
+			line.b += row[x].b;
+			line.a += row[x].a;
+
+			current[x + 1].r = above[x + 1].r + line.r;
+			current[x + 1].g = above[x + 1].g + line.g;
+			current[x + 1].b = above[x + 1].b + line.b;
+			current[x + 1].a = above[x + 1].a + line.a;
+		}
+	}
+}
+
+unsigned int IntegralImage::Width() const {
+	return width;
+}
+
+unsigned int IntegralImage::Height() const {
+	return height;
+}
+
+/**
+ * Returns the average color of the rectangle ul..lr, rounding each
+ * channel's mean to the nearest integer (halves round up).
+ */
+RGBAPixel IntegralImage::Average(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const {
+	const Sums& s11 = At(lr.first + 1, lr.second + 1);
+	const Sums& s01 = At(ul.first, lr.second + 1);
+	const Sums& s10 = At(lr.first + 1, ul.second);
+	const Sums& s00 = At(ul.first, ul.second);
+
+	uint64_t area = (uint64_t) (lr.first - ul.first + 1) * (lr.second - ul.second + 1);
+	uint64_t half = area / 2;
+
+	RGBAPixel avg;
+	avg.r = (s11.r - s01.r - s10.r + s00.r + half) / area;
+	avg.g = (s11.g - s01.g - s10.g + s00.g + half) / area;
+	avg.b = (s11.b - s01.b - s10.b + s00.b + half) / area;
+	avg.a = (s11.a - s01.a - s10.a + s00.a + half) / area;
+	return avg;
+}
+
+const IntegralImage::Sums& IntegralImage::At(unsigned int x, unsigned int y) const {
+	return sums[(size_t) y * (width + 1) + x];
+}
@@ -0,0 +1,61 @@
+#ifndef _INTEGRALIMAGE_H_
+#define _INTEGRALIMAGE_H_
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+#include "cs221util/PNG.h"
+#include "cs221util/RGBAPixel.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * IntegralImage is a summed-area table of a PNG: for every pixel it
+ * stores the sums of the red, green, blue and alpha channels over the
+ * rectangle from the image's upper left corner to that pixel. It is built
+ * in one pass over the image, after which the exact average color of any
+ * rectangle can be found in constant time from four table entries.
+ */
+class IntegralImage {
+public:
+    /**
+     * Builds the summed-area table of img.
+     */
+    IntegralImage(const PNG& img);
+
+    /**
+     * Width of the image the table was built from.
+     */
+    unsigned int Width() const;
+
+    /**
+     * Height of the image the table was built from.
+     */
+    unsigned int Height() const;
+
+    /**
+     * Returns the average color of the pixels in the rectangle ul..lr
+     * (inclusive). Each channel, alpha included, is the exact mean over
+     * the rectangle rounded to the nearest representable value.
+     *
+     * @pre ul.first <= lr.first < Width(), ul.second <= lr.second < Height()
+     */
+    RGBAPixel Average(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const;
+
+private:
+    struct Sums {
+        uint64_t r;
+        uint64_t g;
+        uint64_t b;
+        uint64_t a;
+    };
+
+    unsigned int width;
+    unsigned int height;
+    vector<Sums> sums; // (width + 1) x (height + 1); row 0 and column 0 are zero
+
+    const Sums& At(unsigned int x, unsigned int y) const;
+};
+
+#endif
@@ -0,0 +1,134 @@
+#include "orientation.h"
+#include <algorithm>
+
+/**
+ * Constructs the identity orientation of an empty image.
+ */
+Orientation::Orientation() {
+	xx = 1;
+	xy = 0;
+	yx = 0;
+	yy = 1;
+	tx = 0;
+	ty = 0;
+
+	width = 0;
+	height = 0;
+}
+
+/**
+ * Constructs the identity orientation of a width x height image.
+ */
+Orientation::Orientation(unsigned int width, unsigned int height) {
+	xx = 1;
+	xy = 0;
+	yx = 0;
+	yy = 1;
+	tx = 0;
+	ty = 0;
+
+	this->width = width;
+	this->height = height;
+}
+
+/**
+ * Constructs the orientation of a width x height image whose Code() is
+ * code. The translation puts the displayed image's corner back at the
+ * origin when an axis is reversed.
+ */
+Orientation::Orientation(unsigned int width, unsigned int height, unsigned int code) {
+	int first = (code & 1) ? -1 : 1;
+	int second = (code & 2) ? -1 : 1;
+
+	if (code & 4) {
+		xx = 0;
+		xy = first;
+		yx = second;
+		yy = 0;
+		tx = (first < 0) ? (int) height - 1 : 0;
+		ty = (second < 0) ? (int) width - 1 : 0;
+		this->width = height;
+		this->height = width;
+	} else {
+		xx = first;
+		xy = 0;
+		yx = 0;
+		yy = second;
+		tx = (first < 0) ? (int) width - 1 : 0;
+		ty = (second < 0) ? (int) height - 1 : 0;
+		this->width = width;
+		this->height = height;
+	}
+}
+
+/**
+ * Composes a mirror across the vertical axis onto the orientation:
+ * a displayed (x, y) moves to (width - 1 - x, y).
+ */
+void Orientation::FlipHorizontal() {
+	xx = -xx;
+	xy = -xy;
+	tx = (int) width - 1 - tx;
+}
+
+/**
+ * Composes a 90 degree counter-clockwise rotation onto the orientation:
+ * a displayed (x, y) moves to (y, width - 1 - x).
+ */
+void Orientation::RotateCCW() {
+	int nxx = yx;
+	int nxy = yy;
+	int ntx = ty;
+
+	yx = -xx;
+	yy = -xy;
+	ty = (int) width - 1 - tx;
+
+	xx = nxx;
+	xy = nxy;
+	tx = ntx;
+
+	std::swap(width, height);
+}
+
+unsigned int Orientation::Width() const {
+	return width;
+}
+
+unsigned int Orientation::Height() const {
+	return height;
+}
+
+unsigned int Orientation::Code() const {
+	bool swapped = (xx == 0);
+	int first = swapped ? xy : xx;
+	int second = swapped ? yx : yy;
+	return (swapped ? 4 : 0) | (first < 0 ? 1 : 0) | (second < 0 ? 2 : 0);
+}
+
+bool Orientation::IsIdentity() const {
+	return xx == 1 && yy == 1 && xy == 0 && yx == 0 && tx == 0 && ty == 0;
+}
+
+pair<unsigned int, unsigned int> Orientation::Map(pair<unsigned int, unsigned int> p) const {
+	int x = p.first;
+	int y = p.second;
+	return make_pair(xx * x + xy * y + tx, yx * x + yy * y + ty);
+}
+
+/**
+ * The linear part is a signed permutation matrix, so its inverse is
+ * its transpose.
+ */
+pair<unsigned int, unsigned int> Orientation::Unmap(pair<unsigned int, unsigned int> p) const {
+	int x = (int) p.first - tx;
+	int y = (int) p.second - ty;
+	return make_pair(xx * x + yx * y, xy * x + yy * y);
+}
+
+void Orientation::MapRect(pair<unsigned int, unsigned int>& ul, pair<unsigned int, unsigned int>& lr) const {
+	pair<unsigned int, unsigned int> a = Map(ul);
+	pair<unsigned int, unsigned int> b = Map(lr);
+	ul = make_pair(min(a.first, b.first), min(a.second, b.second));
+	lr = make_pair(max(a.first, b.first), max(a.second, b.second));
+}
@@ -0,0 +1,93 @@
+#ifndef _ORIENTATION_H_
+#define _ORIENTATION_H_
+
+#include <utility>
+
+using namespace std;
+
+/**
+ * Orientation records one of the 8 flip/rotate states (the dihedral group
+ * D4) of a width x height image as a map from the image's original pixel
+ * coordinates to the coordinates at which they are displayed.
+ * Flips and rotations compose into the map in constant time, so a whole
+ * chain of them can be applied to a tree only when it is rendered.
+ */
+class Orientation {
+public:
+    /**
+     * Constructs the identity orientation of an empty image.
+     */
+    Orientation();
+
+    /**
+     * Constructs the identity orientation of a width x height image.
+     */
+    Orientation(unsigned int width, unsigned int height);
+
+    /**
+     * Constructs the orientation of a width x height image (in its
+     * original layout) whose Code() is code.
+     * @pre code < 8
+     */
+    Orientation(unsigned int width, unsigned int height, unsigned int code);
+
+    /**
+     * Composes a mirror across the vertical axis onto the orientation.
+     */
+    void FlipHorizontal();
+
+    /**
+     * Composes a 90 degree counter-clockwise rotation onto the orientation.
+     * This swaps the displayed width and height.
+     */
+    void RotateCCW();
+
+    /**
+     * Width of the image as displayed in this orientation.
+     */
+    unsigned int Width() const;
+
+    /**
+     * Height of the image as displayed in this orientation.
+     */
+    unsigned int Height() const;
+
+    /**
+     * Returns true if the orientation leaves every pixel where it is.
+     */
+    bool IsIdentity() const;
+
+    /**
+     * Identifies which of the 8 orientations this is, as a number below 8,
+     * for storing. Bit 2 is set if rows and columns are swapped; bits 0
+     * and 1 are set if displayed x and y run against the original axis
+     * they come from.
+     */
+    unsigned int Code() const;
+
+    /**
+     * Maps an original pixel coordinate to its displayed coordinate.
+     */
+    pair<unsigned int, unsigned int> Map(pair<unsigned int, unsigned int> p) const;
+
+    /**
+     * Maps a displayed pixel coordinate back to its original coordinate.
+     */
+    pair<unsigned int, unsigned int> Unmap(pair<unsigned int, unsigned int> p) const;
+
+    /**
+     * Maps the original rectangle ul..lr to its displayed rectangle, in place.
+     * ul and lr remain the upper-left and lower-right corners afterwards.
+     */
+    void MapRect(pair<unsigned int, unsigned int>& ul, pair<unsigned int, unsigned int>& lr) const;
+
+private:
+    // displayed (x, y) = (xx * x + xy * y + tx, yx * x + yy * y + ty)
+    int xx, xy, yx, yy;
+    int tx, ty;
+
+    unsigned int width;  // displayed width
+    unsigned int height; // displayed height
+};
+
+#endif
@@ -0,0 +1,239 @@
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Pool is an arena allocator for objects of type T.
+ * Objects are carved out of a handful of large blocks by bumping a
+ * cursor, instead of being individually allocated on the heap. Objects
+ * handed back with Release are kept on a free-list and recycled by later
+ * allocations. Clearing or destroying the pool frees every block at
+ * once without visiting the objects in them, so T must be trivially
+ * destructible.
+ */
+template <class T>
+class Pool {
+public:
+    Pool();
+
+    /**
+     * Pool destructor.
+     * Frees every block owned by the pool. Any object allocated from
+     * the pool is invalid afterwards.
+     */
+    ~Pool();
+
+    /**
+     * Constructs a T from args in the next free slot and returns it.
+     * Recycled slots are used before new ones are carved from a block.
+     */
+    template <class... Args>
+    T* Allocate(Args&&... args);
+
+    /**
+     * Returns obj's slot to the free-list so a later Allocate can reuse it.
+     * @param obj an object previously allocated from this pool, or nullptr.
+     */
+    void Release(T* obj);
+
+    /**
+     * Makes sure that at least count objects can be allocated without
+     * the pool asking the system for more than one additional block.
+     * @param count number of objects expected to be allocated.
+     */
+    void Reserve(size_t count);
+
+    /**
+     * Frees every block owned by the pool in O(number of blocks).
+     * Any object allocated from the pool is invalid afterwards.
+     */
+    void Clear();
+
+    /**
+     * Moves every block owned by other into this pool, leaving other empty.
+     * Objects allocated from other stay valid and are now owned by this pool.
+     */
+    void Splice(Pool& other);
+
+    /**
+     * Exchanges the blocks (and so the objects) of this pool and other
+     * in constant time.
+     */
+    void Swap(Pool& other);
+
+    /**
+     * Number of objects currently allocated from the pool, in constant time.
+     */
+    size_t Size() const;
+
+    /**
+     * Number of Allocate calls since the pool was created or last cleared,
+     * including those made on pools spliced into it.
+     */
+    size_t Allocations() const;
+
+private:
+    union Slot {
+        Slot* next; // link to the next slot on the free-list
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+    };
+
+    static const size_t MIN_BLOCK = 1024;      // slots in the first block
+    static const size_t MAX_BLOCK = 1 << 20;   // slots in a block grown without a Reserve hint
+
+    std::vector<Slot*> blocks; // every block owned by the pool
+    Slot* cursor;              // next never-used slot in the current block
+    Slot* limit;               // one past the last slot of the current block
+    Slot* freeList;            // released slots, linked through Slot::next
+    size_t nextBlock;          // slot count of the next block to be allocated
+    size_t size;               // objects currently allocated
+    size_t allocations;        // objects ever allocated
+
+    void Grow(size_t count);
+
+    Pool(const Pool&) = delete;
+    Pool& operator=(const Pool&) = delete;
+
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "Pool frees its blocks without running destructors");
+};
+
+template <class T>
+Pool<T>::Pool() : cursor(nullptr), limit(nullptr), freeList(nullptr), nextBlock(MIN_BLOCK), size(0), allocations(0) {}
+
+template <class T>
+Pool<T>::~Pool() {
+    Clear();
+}
+
+template <class T>
+template <class... Args>
+T* Pool<T>::Allocate(Args&&... args) {
+    Slot* slot;
+    if (freeList != nullptr) {
+        slot = freeList;
+        freeList = freeList->next;
+    } else {
+        if (cursor == limit) {
+            Grow(nextBlock);
+        }
+        slot = cursor++;
+    }
+    size++;
+    allocations++;
+    return new (&slot->storage) T(std::forward<Args>(args)...);
+}
+
+template <class T>
+void Pool<T>::Release(T* obj) {
+    if (obj == nullptr) {
+        return;
+    }
+    Slot* slot = reinterpret_cast<Slot*>(obj);
+    slot->next = freeList;
+    freeList = slot;
+    size--;
+}
+
+template <class T>
+void Pool<T>::Reserve(size_t count) {
+    size_t available = limit - cursor;
+    if (count > available) {
+        Grow(count - available);
+    }
+}
+
+template <class T>
+void Pool<T>::Clear() {
+    for (size_t i = 0; i < blocks.size(); i++) {
+        ::operator delete(blocks[i]);
+    }
+    blocks.clear();
+    cursor = nullptr;
+    limit = nullptr;
+    freeList = nullptr;
+    nextBlock = MIN_BLOCK;
+    size = 0;
+    allocations = 0;
+}
+
+template <class T>
+void Pool<T>::Splice(Pool& other) {
+    if (this == &other) {
+        return;
+    }
+    blocks.insert(blocks.end(), other.blocks.begin(), other.blocks.end());
+
+    // keep other's unused tail around as free slots rather than dropping it
+    while (other.cursor != other.limit) {
+        Slot* slot = other.cursor++;
+        slot->next = other.freeList;
+        other.freeList = slot;
+    }
+    if (other.freeList != nullptr) {
+        Slot* tail = other.freeList;
+        while (tail->next != nullptr) {
+            tail = tail->next;
+        }
+        tail->next = freeList;
+        freeList = other.freeList;
+    }
+
+    size += other.size;
+    allocations += other.allocations;
+
+    other.blocks.clear();
+    other.cursor = nullptr;
+    other.limit = nullptr;
+    other.freeList = nullptr;
+    other.nextBlock = MIN_BLOCK;
+    other.size = 0;
+    other.allocations = 0;
+}
+
+template <class T>
+void Pool<T>::Swap(Pool& other) {
+    blocks.swap(other.blocks);
+    std::swap(cursor, other.cursor);
+    std::swap(limit, other.limit);
+    std::swap(freeList, other.freeList);
+    std::swap(nextBlock, other.nextBlock);
+    std::swap(size, other.size);
+    std::swap(allocations, other.allocations);
+}
+
+template <class T>
+size_t Pool<T>::Size() const {
+    return size;
+}
+
+template <class T>
+size_t Pool<T>::Allocations() const {
+    return allocations;
+}
+
+template <class T>
+void Pool<T>::Grow(size_t count) {
+    // any slots left in the current block go onto the free-list
+    while (cursor != limit) {
+        Slot* slot = cursor++;
+        slot->next = freeList;
+        freeList = slot;
+    }
+
+    size_t size = count > nextBlock ? count : nextBlock;
+    cursor = static_cast<Slot*>(::operator new(size * sizeof(Slot)));
+    limit = cursor + size;
+    blocks.push_back(cursor);
+
+    if (nextBlock < MAX_BLOCK) {
+        nextBlock *= 2;
+    }
+}
+
+#endif
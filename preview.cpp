@@ -0,0 +1,56 @@
+#include "preview.h"
+
+/**
+ * Starts a preview of tree at the given scale by drawing the root.
+ */
+QTreePreview::QTreePreview(const QTree& tree, unsigned int scale)
+	: tree(tree), scale(scale), depth(0), img(tree.width * scale, tree.height * scale) {
+	const Node* root = tree.root;
+	if (root == nullptr) {
+		return;
+	}
+	tree.FillRect(img, root, scale);
+	if (root->NW != nullptr || root->NE != nullptr || root->SW != nullptr || root->SE != nullptr) {
+		frontier.push_back(root);
+	}
+}
+
+/**
+ * Draws the children of every frontier node, which together cover exactly
+ * the frontier's rectangles, and makes the children that have children
+ * of their own the new frontier.
+ */
+bool QTreePreview::Refine() {
+	if (frontier.empty()) {
+		return false;
+	}
+
+	vector<const Node*> next;
+	for (const Node* nd : frontier) {
+		const Node* children[4] = { nd->NW, nd->NE, nd->SW, nd->SE };
+		for (const Node* child : children) {
+			if (child == nullptr) {
+				continue;
+			}
+			tree.FillRect(img, child, scale);
+			if (child->NW != nullptr || child->NE != nullptr || child->SW != nullptr || child->SE != nullptr) {
+				next.push_back(child);
+			}
+		}
+	}
+	frontier.swap(next);
+	depth++;
+	return true;
+}
+
+bool QTreePreview::Complete() const {
+	return frontier.empty();
+}
+
+unsigned int QTreePreview::Depth() const {
+	return depth;
+}
+
+const PNG& QTreePreview::Image() const {
+	return img;
+}
@@ -0,0 +1,63 @@
+#ifndef _PREVIEW_H_
+#define _PREVIEW_H_
+
+#include <vector>
+#include "cs221util/PNG.h"
+#include "qtree.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * QTreePreview renders a QTree progressively, one level at a time, for
+ * streaming successively sharper previews of the same image.
+ * It starts with the root drawn alone; every Refine draws the children of
+ * the nodes drawn last, over their parents, so after Refine has been
+ * called d times the image equals tree.Render(scale, d). Each level is
+ * visited once: the preview keeps the nodes of the last level that still
+ * have children, so no level already drawn is walked again.
+ *
+ * The tree must outlive the preview and must not be modified while the
+ * preview is in use; flips and rotations are taken from the tree when the
+ * preview is constructed.
+ */
+class QTreePreview {
+public:
+    /**
+     * Starts a preview of tree at the given scale, drawn at depth 0.
+     * @pre scale > 0
+     */
+    QTreePreview(const QTree& tree, unsigned int scale);
+
+    /**
+     * Draws the next level of the tree over the current image.
+     * @return false, and leaves the image as it is, if the image already
+     * shows every leaf.
+     */
+    bool Refine();
+
+    /**
+     * Returns true once the image shows every leaf, i.e. equals
+     * tree.Render(scale).
+     */
+    bool Complete() const;
+
+    /**
+     * Depth of the nodes most recently drawn.
+     */
+    unsigned int Depth() const;
+
+    /**
+     * The image as drawn so far.
+     */
+    const PNG& Image() const;
+
+private:
+    const QTree& tree;
+    unsigned int scale;
+    unsigned int depth;
+    PNG img;
+    vector<const Node*> frontier; // nodes drawn last that still have children
+};
+
+#endif
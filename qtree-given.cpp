@@ -1,4 +1,5 @@
 #include "qtree.h"
+#include "traversal.h"
 
  /**
   * Node constructor.
@@ -8,6 +9,8 @@ Node::Node(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int>
 	upLeft = ul;
 	lowRight = lr;
 	avg = a;
+	tier = NO_TIER;
+	refs = 1;
 
 	NW = nullptr;
 	NE = nullptr;
@@ -37,6 +40,20 @@ QTree::QTree(const QTree& other) {
 	Copy(other);
 }
 
+/**
+ * Move constructor for a QTree.
+ * Takes over other's nodes without copying them; other is left as
+ * an empty tree.
+ *
+ * @param other The QTree we are moving from.
+ */
+QTree::QTree(QTree&& other) noexcept {
+	root = NULL;
+	height = 0;
+	width = 0;
+	Swap(other);
+}
+
 /**
  * Counts the number of nodes in the tree
  */
@@ -56,10 +73,12 @@ unsigned int QTree::CountLeaves() const {
  * @param nd the root of the subtree whose nodes we want to count
  */
 unsigned int QTree::CountNodes(Node* nd) const {
-	if (nd == nullptr)
-		return 0;
-	else
-		return 1 + CountNodes(nd->NW) + CountNodes(nd->NE) + CountNodes(nd->SW) + CountNodes(nd->SE);
+	unsigned int count = 0;
+	PreOrder(nd, [&count](Node*) {
+		count++;
+		return DESCEND;
+	});
+	return count;
 }
 
 /**
@@ -67,12 +86,11 @@ unsigned int QTree::CountNodes(Node* nd) const {
  * @param nd the root of the subtree whose leaves we want to count
  */
 unsigned int QTree::CountLeaves(Node* nd) const {
-	if (nd == nullptr)
-		return 0;
-	else {
-		if (nd->NW == nullptr && nd->NE == nullptr && nd->SW == nullptr && nd->SE == nullptr)
-			return 1;
-		else
-			return CountLeaves(nd->NW) + CountLeaves(nd->NE) + CountLeaves(nd->SW) + CountLeaves(nd->SE);
-	}
+	unsigned int count = 0;
+	PreOrder(nd, [&count](Node* n) {
+		if (n->NW == nullptr && n->NE == nullptr && n->SW == nullptr && n->SE == nullptr)
+			count++;
+		return DESCEND;
+	});
+	return count;
 }
\ No newline at end of file
@@ -1,21 +1,112 @@
+// CompactQTree(const QTree&) copies the nodes straight out of the tree,
+// QTreePreview draws them level by level, and QTreeTest (qtree-test.cpp)
+// compares them against reference trees
+friend class CompactQTree;
+friend class QTreePreview;
+friend class QTreeTest;
+
+// arena that owns every node of this tree, and of the copies it shares
+// nodes with; see pool.h. Created by the constructors that build a tree,
+// and null in a tree that never had nodes, so that copies and moves do
+// not allocate.
+shared_ptr<Pool<Node>> pool;
+
+// number of nodes and of leaves in the tree; see NodeCount and LeafCount
+unsigned int nodeCount = 0;
+unsigned int leafCount = 0;
+
+// true if node averages are exact means of their rectangles, as built with
+// BuildOptions::exactAverages; Update keeps them that way
+bool exactAverages = false;
+
+// only updated when compiled with QTREE_STATS; see Stats
+mutable QTreeStats stats;
+
+// pending flips/rotations, applied when the tree is rendered. Nodes always
+// keep the layout they were built with.
+Orientation orientation;
+
+void Swap(QTree& other);
+
+Node* BuildNode(const PNG& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, Pool<Node>& nodes);
+
+Node* BuildParallel(const PNG& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                    unsigned int threads, unsigned int cutoff, Pool<Node>& nodes);
+
+template <class Pixels>
+void FillSubtree(const Pixels& img, Node* subtree, Pool<Node>& nodes);
+
+template <class Pixels, class Finish>
+void FillSubtree(const Pixels& img, Node* subtree, Pool<Node>& nodes, Finish finish);
+
+void BuildBand(RowSource& source, vector<RGBAPixel>& row, const vector<Node*>& band, unsigned int top, unsigned int bottom);
+
+void AssignExactAverages(Node* subtree, const IntegralImage& sums);
+
 void ClearSubtree(Node*& subtree);
 
 Node* CopyNode(Node* other);
 
+Node* Unshare(Node* target);
+
+Node* Detach(Node* nd);
+
+void UnshareAll();
+
 void RenderPixel(PNG &img, Node* pixel, unsigned int scale) const;
 
-void assignColor(Node*& subtree, string mode);
+void FillRect(PNG &img, const Node* nd, unsigned int scale) const;
+
+void RenderBand(PNG &img, unsigned int top, unsigned int bottom, unsigned int scale, uint64_t& painted) const;
+
+void PaintRegion(PNG &img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                 pair<unsigned int, unsigned int> origin, unsigned int scale, uint64_t& painted) const;
+
+bool ClipToCanonical(pair<unsigned int, unsigned int>& ul, pair<unsigned int, unsigned int>& lr) const;
+
+// how a node's rectangle is split: 1xN into NW/SW, Nx1 into NW/NE, or
+// into all four quadrants
+enum SplitShape { SPLIT_VERTICAL, SPLIT_HORIZONTAL, SPLIT_QUAD };
+
+template <SplitShape shape>
+void assignColor(Node* subtree);
+
+// bounds of the premultiplied r, g, b and alpha of a subtree's leaves,
+// with the colors of the leaves that attain them
+struct ColorBounds {
+    double lo[4];
+    double hi[4];
+    RGBAPixel minColor[4];
+    RGBAPixel maxColor[4];
+};
+
+static ColorBounds LeafBounds(RGBAPixel c);
 
-void FlipNode(Node*& subtree);
+static void Widen(ColorBounds& bounds, const ColorBounds& other);
 
-void positionNormal(Node*& subtree, int width1, int height1);
+void PruneNode(Node* subtree, double tolerance, size_t mark, vector<Node*>& collapse, vector<ColorBounds>& bounds);
 
-void RotateSubtree(Node*& subtree);
+const ColorBounds& MergeBounds(Node* subtree, vector<ColorBounds>& bounds);
 
-void coordinateHelper(Node*& subtree, int width1, int width2, int height1);
+static double CornerBound(RGBAPixel a, const ColorBounds& bounds);
 
-void PruneNode(Node*& subtree, double tolerance);
+bool CanPrune(Node* subtree, const ColorBounds& bounds, double tolerance, const PNG* img = nullptr);
+
+void PruneBuilt(const PNG& img, Node* subtree, double tolerance, vector<ColorBounds>& bounds);
+
+static bool RectWithinTolerance(const PNG& img, const Node* subtree, RGBAPixel a, double tolerance);
 
 void DeleteChildren(Node*& subtree);
 
-bool shouldPrune(Node* subtree, RGBAPixel a, double tolerance);
\ No newline at end of file
+void CountSubtree(Node* subtree, unsigned int& nodes, unsigned int& leaves) const;
+
+unsigned int MaxDepth() const;
+
+bool shouldPrune(Node* subtree, RGBAPixel a, double tolerance);
+
+// tolerances given to AnnotateTiers; a node's tier indexes into them
+vector<double> tiers;
+
+unsigned char TierOf(Node* subtree, const ColorBounds& bounds);
+
+double MaxLeafDistance(Node* subtree, RGBAPixel a);
\ No newline at end of file
@@ -0,0 +1,392 @@
+/**
+ * Differential tests of the QTree operations that were rewritten for
+ * speed, each checked against a plain reference on the same images:
+ *  - Prune, and the pruning constructor, against the original top-down
+ *    prune, run on a snapshot of the unpruned tree;
+ *  - Update against a fresh build of the changed image;
+ *  - copies (which share nodes) against snapshots taken before either
+ *    side was modified.
+ * Trees are compared node for node: rectangle, average and children.
+ * It also checks that CompactQTree::ReadFromFile rejects damaged files.
+ *
+ * Run by `make test`; prints one line per test and exits with a nonzero
+ * status if any comparison fails.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "cqtree.h"
+#include "qtree.h"
+
+using namespace std;
+
+/**
+ * A plain copy of one node of a QTree and of its subtree.
+ */
+struct RefNode {
+	pair<unsigned int, unsigned int> upLeft;
+	pair<unsigned int, unsigned int> lowRight;
+	RGBAPixel avg;
+	unique_ptr<RefNode> children[4]; // NW, NE, SW, SE
+
+	bool IsLeaf() const {
+		return !children[0] && !children[1] && !children[2] && !children[3];
+	}
+};
+
+/**
+ * Reads the nodes of a QTree, which it is a friend of.
+ */
+class QTreeTest {
+public:
+	/**
+	 * Copies the nodes of tree, or returns nullptr for an empty tree.
+	 */
+	static unique_ptr<RefNode> Snapshot(const QTree& tree) {
+		return Copy(tree.root);
+	}
+
+private:
+	static unique_ptr<RefNode> Copy(const Node* nd) {
+		if (nd == nullptr) {
+			return unique_ptr<RefNode>();
+		}
+		unique_ptr<RefNode> ref(new RefNode());
+		ref->upLeft = nd->upLeft;
+		ref->lowRight = nd->lowRight;
+		ref->avg = nd->avg;
+		const Node* children[4] = { nd->NW, nd->NE, nd->SW, nd->SE };
+		for (int k = 0; k < 4; k++) {
+			ref->children[k] = Copy(children[k]);
+		}
+		return ref;
+	}
+};
+
+/**
+ * Returns true if the two subtrees have the same shape, rectangles and
+ * averages (all four channels, exactly).
+ */
+static bool SameTree(const RefNode* a, const RefNode* b) {
+	if (a == nullptr || b == nullptr) {
+		return a == b;
+	}
+	if (a->upLeft != b->upLeft || a->lowRight != b->lowRight || a->avg.r != b->avg.r || a->avg.g != b->avg.g
+	    || a->avg.b != b->avg.b || a->avg.a != b->avg.a) {
+		return false;
+	}
+	for (int k = 0; k < 4; k++) {
+		if (!SameTree(a->children[k].get(), b->children[k].get())) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool SameTree(const QTree& a, const QTree& b) {
+	return SameTree(QTreeTest::Snapshot(a).get(), QTreeTest::Snapshot(b).get());
+}
+
+/**
+ * The original criterion: every leaf of the subtree is within tolerance
+ * of a.
+ */
+static bool LeavesWithin(const RefNode* nd, RGBAPixel a, double tolerance) {
+	if (nd->IsLeaf()) {
+		RGBAPixel leaf = nd->avg;
+		return leaf.distanceTo(a) <= tolerance;
+	}
+	for (int k = 0; k < 4; k++) {
+		if (nd->children[k] && !LeavesWithin(nd->children[k].get(), a, tolerance)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * The original top-down prune: a node whose leaves are all within
+ * tolerance of its average loses its children, and the survivors are
+ * visited in turn.
+ */
+static void ReferencePrune(RefNode* nd, double tolerance) {
+	if (nd == nullptr || nd->IsLeaf()) {
+		return;
+	}
+	if (LeavesWithin(nd, nd->avg, tolerance)) {
+		for (int k = 0; k < 4; k++) {
+			nd->children[k].reset();
+		}
+		return;
+	}
+	for (int k = 0; k < 4; k++) {
+		ReferencePrune(nd->children[k].get(), tolerance);
+	}
+}
+
+static unsigned int CountRefNodes(const RefNode* nd) {
+	if (nd == nullptr) {
+		return 0;
+	}
+	unsigned int count = 1;
+	for (int k = 0; k < 4; k++) {
+		count += CountRefNodes(nd->children[k].get());
+	}
+	return count;
+}
+
+/**
+ * Fills an image with blocks of a few colors plus some noise, so that
+ * subtrees of every size are prunable at some tolerance. A third of the
+ * images have no noise and are opaque, so that leaves sit exactly on
+ * their parents' averages and a tolerance of 0 still prunes.
+ */
+static PNG RandomImage(unsigned int width, unsigned int height) {
+	PNG img(width, height);
+	unsigned int block = 1 + rand() % 8;
+	bool flat = (rand() % 3 == 0);
+	unsigned int noise = flat ? 1 : 1 + rand() % 12;
+	for (unsigned int y = 0; y < height; y++) {
+		for (unsigned int x = 0; x < width; x++) {
+			unsigned int cell = (x / block) * 7 + (y / block) * 13;
+			RGBAPixel& p = img(x, y);
+			p.r = (cell * 40) % 256 + rand() % noise;
+			p.g = (cell * 90) % 256 + rand() % noise;
+			p.b = (cell * 20) % 256;
+			p.a = (!flat && rand() % 6 == 0) ? 255 - rand() % 40 : 255;
+		}
+	}
+	return img;
+}
+
+/**
+ * Changes the pixels of a random rectangle of img, and returns the
+ * rectangle in ul and lr.
+ */
+static void ChangeRect(PNG& img, pair<unsigned int, unsigned int>& ul, pair<unsigned int, unsigned int>& lr) {
+	ul = make_pair(rand() % img.width(), rand() % img.height());
+	lr = make_pair(min(img.width() - 1, ul.first + rand() % 16), min(img.height() - 1, ul.second + rand() % 16));
+	for (unsigned int y = ul.second; y <= lr.second; y++) {
+		for (unsigned int x = ul.first; x <= lr.first; x++) {
+			img(x, y).r = rand();
+			img(x, y).g = rand();
+			img(x, y).a = 255 - rand() % 3;
+		}
+	}
+}
+
+static const double TOLERANCES[] = { 0.0, 0.005, 0.01, 0.02, 0.05, 0.1, 0.3 };
+static const unsigned int TRIALS = 150;
+
+/**
+ * Prune, and the constructor that prunes while building, against the
+ * original top-down prune.
+ */
+static unsigned int TestPrune() {
+	unsigned int failures = 0;
+	for (unsigned int t = 0; t < TRIALS; t++) {
+		PNG img = RandomImage(1 + rand() % 40, 1 + rand() % 40);
+		for (double tol : TOLERANCES) {
+			QTree tree(img);
+			unique_ptr<RefNode> ref = QTreeTest::Snapshot(tree);
+			ReferencePrune(ref.get(), tol);
+
+			tree.Prune(tol);
+			QTree built(img, tol);
+			unique_ptr<RefNode> pruned = QTreeTest::Snapshot(tree);
+			if (!SameTree(pruned.get(), ref.get()) || tree.CountNodes() != CountRefNodes(ref.get())
+			    || tree.NodeCount() != tree.CountNodes() || !SameTree(QTreeTest::Snapshot(built).get(), ref.get())) {
+				failures++;
+			}
+		}
+	}
+	return failures;
+}
+
+/**
+ * Update, after a few random edits, against a fresh build of the edited
+ * image, with rounded and with exact averages.
+ */
+static unsigned int TestUpdate() {
+	unsigned int failures = 0;
+	for (unsigned int t = 0; t < TRIALS; t++) {
+		PNG img = RandomImage(1 + rand() % 40, 1 + rand() % 40);
+		BuildOptions options;
+		options.exactAverages = (t % 2 == 1);
+		QTree tree(img, options);
+		for (int edit = 0; edit < 3; edit++) {
+			pair<unsigned int, unsigned int> ul, lr;
+			ChangeRect(img, ul, lr);
+			tree.Update(img, ul, lr);
+			QTree fresh(img, options);
+			if (!SameTree(tree, fresh) || tree.NodeCount() != fresh.NodeCount() || tree.LeafCount() != fresh.LeafCount()) {
+				failures++;
+			}
+		}
+	}
+	return failures;
+}
+
+/**
+ * Copies share nodes with the tree they were copied from. Every
+ * operation that modifies one side must leave the other as it was.
+ */
+static unsigned int TestCopies() {
+	unsigned int failures = 0;
+	for (unsigned int t = 0; t < TRIALS; t++) {
+		PNG img = RandomImage(1 + rand() % 40, 1 + rand() % 40);
+		for (int op = 0; op < 6; op++) {
+			QTree original(img);
+			original.RotateCCW();
+			QTree copy(original);
+			if (t % 2 == 1) {
+				// modify the copy instead, and check the original
+				swap(original, copy);
+			}
+			unique_ptr<RefNode> before = QTreeTest::Snapshot(copy);
+			PNG rendered = copy.Render(1);
+
+			PNG changed = img;
+			pair<unsigned int, unsigned int> ul, lr;
+			switch (op) {
+			case 0:
+				original.Prune(0.05);
+				break;
+			case 1:
+				original.FlipHorizontal();
+				original.RotateCCW();
+				break;
+			case 2:
+				ChangeRect(changed, ul, lr);
+				original.Update(changed, ul, lr);
+				break;
+			case 3:
+				original.AnnotateTiers(vector<double>(TOLERANCES, TOLERANCES + 7));
+				original.PruneToTier(4);
+				break;
+			case 4:
+				original = QTree(RandomImage(img.width(), img.height()));
+				break;
+			case 5:
+				original.Prune(0.1);
+				original = copy;
+				original.Prune(0.02);
+				break;
+			}
+			if (!SameTree(QTreeTest::Snapshot(copy).get(), before.get()) || !(copy.Render(1) == rendered)) {
+				failures++;
+			}
+		}
+	}
+	return failures;
+}
+
+static const char* TREE_FILE = "qtree-test.cqt";
+
+static vector<char> ReadBytes(const char* fileName) {
+	ifstream in(fileName, ios::binary);
+	return vector<char>(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+}
+
+/**
+ * Writes bytes to TREE_FILE and returns whether a CompactQTree loads it.
+ */
+static bool Loads(const vector<char>& bytes) {
+	ofstream(TREE_FILE, ios::binary).write(bytes.data(), bytes.size());
+	CompactQTree tree;
+	return tree.ReadFromFile(TREE_FILE);
+}
+
+/**
+ * Offset in a tree file of the 4-bit child mask of node i; the header is
+ * 32 bytes and masks are packed two to a byte, low nibble first.
+ */
+static size_t MaskByte(unsigned int i) {
+	return 32 + i / 2;
+}
+
+/**
+ * CompactQTree::ReadFromFile on a saved 3x4 tree, which has 17 nodes in
+ * two mask words, and on damaged copies of it: every truncation, every
+ * flipped mask bit, a changed rank word, a wrong version and a node
+ * whose children do not fit its rectangle. Only the undamaged file may
+ * load, and it must render as the tree that was saved.
+ */
+static unsigned int TestCompactFiles() {
+	unsigned int failures = 0;
+	PNG img = RandomImage(3, 4);
+	CompactQTree saved(img);
+	if (!saved.WriteToFile(TREE_FILE)) {
+		return 1;
+	}
+	const vector<char> good = ReadBytes(TREE_FILE);
+
+	// the rejections are expected; keep their messages out of the report
+	streambuf* errors = cerr.rdbuf(nullptr);
+
+	CompactQTree loaded;
+	if (!loaded.ReadFromFile(TREE_FILE) || !(loaded.Render(1) == saved.Render(1))
+	    || loaded.CountNodes() != saved.CountNodes() || loaded.CountLeaves() != saved.CountLeaves()) {
+		failures++;
+	}
+
+	for (size_t size = 0; size < good.size(); size++) {
+		failures += Loads(vector<char>(good.begin(), good.begin() + size));
+	}
+
+	// 17 nodes take two 8-byte mask words
+	for (size_t bit = 0; bit < 16 * 8; bit++) {
+		vector<char> bytes = good;
+		bytes[32 + bit / 8] ^= 1 << (bit % 8);
+		failures += Loads(bytes);
+	}
+
+	// the second rank word counts the children of the first 16 nodes
+	vector<char> bytes = good;
+	uint32_t rank;
+	memcpy(&rank, &bytes[32 + 16 + 4], sizeof(rank));
+	rank++;
+	memcpy(&bytes[32 + 16 + 4], &rank, sizeof(rank));
+	failures += Loads(bytes);
+
+	bytes = good;
+	uint32_t version;
+	memcpy(&version, &bytes[8], sizeof(version));
+	version++;
+	memcpy(&bytes[8], &version, sizeof(version));
+	failures += Loads(bytes);
+
+	// node 4 is the 1x2 column at the right of the top half, split into
+	// NW and SW (mask 5); NE and SE (mask 10) keep every count and rank
+	// the same, but do not exist in a column
+	bytes = good;
+	if ((bytes[MaskByte(4)] & 15) != 5) {
+		failures++;
+	}
+	bytes[MaskByte(4)] = (bytes[MaskByte(4)] & ~15) | 10;
+	failures += Loads(bytes);
+
+	cerr.rdbuf(errors);
+	remove(TREE_FILE);
+	return failures;
+}
+
+static bool Report(const string& name, unsigned int failures) {
+	cout << name << ": " << (failures == 0 ? "OK" : to_string(failures) + " FAILED") << endl;
+	return failures == 0;
+}
+
+int main() {
+	srand(221);
+	bool ok = Report("TestPrune", TestPrune());
+	ok = Report("TestUpdate", TestUpdate()) && ok;
+	ok = Report("TestCopies", TestCopies()) && ok;
+	ok = Report("TestCompactFiles", TestCompactFiles()) && ok;
+	return ok ? 0 : 1;
+}
@@ -1,5 +1,11 @@
 #include "qtree.h"
+#include "colorkernel.h"
+#include "traversal.h"
+#include <algorithm>
+#include <cassert>
 #include <cmath>
+#include <cstring>
+#include <thread>
 
 /**
  * Constructor that builds a QTree out of the given PNG.
@@ -35,25 +41,287 @@
  * that when combined, completely cover the original rectangle's image
  * region and do not overlap.
  */
-QTree::QTree(const PNG& imIn) {
+QTree::QTree(const PNG& imIn) : pool(make_shared<Pool<Node>>()), orientation(imIn.width(), imIn.height()) {
+	QTREE_STAT(StatsPhase<Node> phase(stats.buildSeconds, stats, pool));
 	height = imIn.height();
 	width = imIn.width();
+	pool->Reserve(width * height + width * height / 3 + width + height);
 	root = BuildNode(imIn, make_pair(0,0), make_pair(width - 1, height - 1));
+	nodeCount = pool->Size();
+	leafCount = width * height;
+}
+
+BuildOptions::BuildOptions() {
+	threads = 0;
+	serialCutoff = 1 << 16;
+	exactAverages = false;
+}
+
+/**
+ * Constructor that builds the same QTree as QTree(imIn), using up to
+ * options.threads threads. The result is identical to the serial
+ * build, node for node, unless options.exactAverages is set, in which
+ * case the splits are the same but every node holds the exact average
+ * color of its rectangle.
+ *
+ * @param imIn the image to build the tree from.
+ * @param options how the tree is to be built; see BuildOptions.
+ */
+QTree::QTree(const PNG& imIn, const BuildOptions& options)
+	: pool(make_shared<Pool<Node>>()), orientation(imIn.width(), imIn.height()) {
+	QTREE_STAT(StatsPhase<Node> phase(stats.buildSeconds, stats, pool));
+	height = imIn.height();
+	width = imIn.width();
+
+	unsigned int threads = options.threads;
+	if (threads == 0) {
+		threads = std::thread::hardware_concurrency();
+	}
+	if (threads == 0) {
+		threads = 1;
+	}
+	root = BuildParallel(imIn, make_pair(0,0), make_pair(width - 1, height - 1), threads, options.serialCutoff, *pool);
+	nodeCount = pool->Size();
+	leafCount = width * height;
+
+	exactAverages = options.exactAverages;
+	if (exactAverages) {
+		AssignExactAverages(root, IntegralImage(imIn));
+	}
+}
+
+/**
+ * Constructor that builds the same QTree as QTree(imIn) followed by
+ * Prune(tolerance). The tree is built depth first as usual, but every
+ * internal node is tested against the prune criterion as soon as its
+ * average is known, and collapsed if it meets it; its nodes go back to
+ * the pool and are reused by the rest of the build. The criterion is
+ * still evaluated against the pixels, not against the leaves left by
+ * collapses below, so the result is the same as pruning the full tree.
+ *
+ * @param imIn the image to build the tree from.
+ * @param tolerance the prune tolerance.
+ */
+QTree::QTree(const PNG& imIn, double tolerance)
+	: pool(make_shared<Pool<Node>>()), orientation(imIn.width(), imIn.height()) {
+	QTREE_STAT(StatsPhase<Node> phase(stats.buildSeconds, stats, pool));
+	height = imIn.height();
+	width = imIn.width();
+	root = pool->Allocate(make_pair(0,0), make_pair(width - 1, height - 1), RGBAPixel());
+
+	// every pixel is a leaf at some point, and each collapse takes its
+	// leaves off the count; the node count is read off the pool, which
+	// only this tree uses
+	leafCount = width * height;
+	vector<ColorBounds> bounds;
+	FillSubtree(imIn, root, *pool, [&](Node* nd) {
+		PruneBuilt(imIn, nd, tolerance, bounds);
+	});
+	nodeCount = pool->Size();
+}
+
+/**
+ * Private helper for the pruning constructor, run on each internal node
+ * once its subtree is built and its average assigned. Replaces the pixel
+ * bounds of the node's children on top of the bounds stack with the
+ * bounds of the node's pixels, and collapses the node if it meets the
+ * prune criterion. Single pixels never get an entry of their own; their
+ * bounds are taken straight from their color.
+ */
+void QTree::PruneBuilt(const PNG& img, Node* subtree, double tolerance, vector<ColorBounds>& bounds) {
+	Node* children[4] = { subtree->NW, subtree->NE, subtree->SW, subtree->SE };
+	size_t count = 0;
+	for (int k = 0; k < 4; k++) {
+		if (children[k] != nullptr && children[k]->upLeft != children[k]->lowRight) {
+			count++;
+		}
+	}
+
+	size_t next = bounds.size() - count;
+	size_t first = next;
+	ColorBounds merged;
+	bool empty = true;
+	for (int k = 0; k < 4; k++) {
+		if (children[k] == nullptr) {
+			continue;
+		}
+		ColorBounds child = (children[k]->upLeft == children[k]->lowRight) ? LeafBounds(children[k]->avg) : bounds[next++];
+		if (empty) {
+			merged = child;
+			empty = false;
+		} else {
+			Widen(merged, child);
+		}
+	}
+	bounds.resize(first);
+
+	if (CanPrune(subtree, merged, tolerance, &img)) {
+		DeleteChildren(subtree);
+	}
+	bounds.push_back(merged);
+}
+
+/**
+ * Returns true if every pixel of img in subtree's rectangle is within
+ * tolerance of a, testing a row of the rectangle at a time.
+ */
+bool QTree::RectWithinTolerance(const PNG& img, const Node* subtree, RGBAPixel a, double tolerance) {
+	unsigned int x = subtree->upLeft.first;
+	unsigned int count = subtree->lowRight.first - x + 1;
+	for (unsigned int y = subtree->upLeft.second; y <= subtree->lowRight.second; y++) {
+		if (!allWithinDistance(a, img.getPixel(x, y), count, tolerance)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/**
+ * Replaces the average color of every node of the subtree with the exact
+ * average of its rectangle, read in constant time from sums.
+ */
+void QTree::AssignExactAverages(Node* subtree, const IntegralImage& sums) {
+	PreOrder(subtree, [&](Node* nd) {
+		nd->avg = sums.Average(nd->upLeft, nd->lowRight);
+		return DESCEND;
+	});
+}
+
+/**
+ * Constructor that builds the same QTree as QTree(imIn) from an image
+ * read one row at a time, top to bottom, so the whole image never has to
+ * be in memory. If the source fails partway, the rows it could not
+ * provide are built as default (opaque black) pixels.
+ *
+ * @param source the rows of the image.
+ */
+QTree::QTree(RowSource& source) : pool(make_shared<Pool<Node>>()), orientation(source.Width(), source.Height()) {
+	QTREE_STAT(StatsPhase<Node> phase(stats.buildSeconds, stats, pool));
+	height = source.Height();
+	width = source.Width();
+	pool->Reserve(width * height + width * height / 3 + width + height);
+	root = pool->Allocate(make_pair(0,0), make_pair(width - 1, height - 1), RGBAPixel());
+
+	vector<RGBAPixel> row(width);
+	vector<Node*> band(1, root);
+	BuildBand(source, row, band, 0, height - 1);
+	nodeCount = pool->Size();
+	leafCount = width * height;
+}
+
+/**
+ * Private helper for the streaming constructor: looks up pixels in the
+ * single row currently held in memory.
+ */
+struct RowPixels {
+	const RGBAPixel* row;
+
+	const RGBAPixel& operator()(unsigned int x, unsigned int) const {
+		return row[x];
+	}
+};
+
+/**
+ * Private helper for the streaming constructor. Builds the subtrees of
+ * band, every node of which spans rows top..bottom.
+ * A node's rows are split the same way whatever its columns, so all the
+ * children covering the upper rows form one band, and those covering the
+ * lower rows another. Building the upper band completely before the lower
+ * one consumes the source's rows strictly in order, and a node's average
+ * is combined as soon as both of its bands are done. Once a band is a
+ * single row, that row is read into the buffer and each node's remaining
+ * subtree is built from it.
+ */
+void QTree::BuildBand(RowSource& source, vector<RGBAPixel>& row, const vector<Node*>& band, unsigned int top, unsigned int bottom) {
+	if (top == bottom) {
+		if (!source.ReadRow(row.data())) {
+			std::fill(row.begin(), row.end(), RGBAPixel());
+		}
+		RowPixels pixels = { row.data() };
+		for (Node* nd : band) {
+			FillSubtree(pixels, nd, *pool);
+		}
+		return;
+	}
+
+	unsigned int halfh = (bottom - top + 2) / 2;
+	vector<Node*> upper;
+	vector<Node*> lower;
+	for (Node* nd : band) {
+		pair<unsigned int, unsigned int> ul = nd->upLeft;
+		pair<unsigned int, unsigned int> lr = nd->lowRight;
+		unsigned int x = lr.first - ul.first + 1;
+		unsigned int halfw = (x + 1) / 2;
+
+		nd->NW = pool->Allocate(ul, make_pair(ul.first + halfw - 1, ul.second + halfh - 1), RGBAPixel());
+		nd->SW = pool->Allocate(make_pair(ul.first, ul.second + halfh), make_pair(ul.first + halfw - 1, lr.second), RGBAPixel());
+		upper.push_back(nd->NW);
+		if (x > 1) {
+			nd->NE = pool->Allocate(make_pair(ul.first + halfw, ul.second), make_pair(lr.first, ul.second + halfh - 1), RGBAPixel());
+			upper.push_back(nd->NE);
+		}
+		lower.push_back(nd->SW);
+		if (x > 1) {
+			nd->SE = pool->Allocate(make_pair(ul.first + halfw, ul.second + halfh), lr, RGBAPixel());
+			lower.push_back(nd->SE);
+		}
+	}
+
+	BuildBand(source, row, upper, top, top + halfh - 1);
+	BuildBand(source, row, lower, top + halfh, bottom);
+
+	for (Node* nd : band) {
+		if (nd->SE != nullptr) {
+			assignColor<SPLIT_QUAD>(nd);
+		} else {
+			assignColor<SPLIT_VERTICAL>(nd);
+		}
+	}
 }
 
 /**
  * Overloaded assignment operator for QTrees.
  * Part of the Big Three that we must define because the class
- * allocates dynamic memory. This depends on your implementation
- * of the copy and clear funtions.
+ * allocates dynamic memory. Copies rhs and swaps the copy in, so the
+ * old tree is freed and self-assignment is safe.
  *
  * @param rhs The right hand side of the assignment statement.
  */
 QTree& QTree::operator=(const QTree& rhs) {
-	Copy(rhs);
+	QTree copy(rhs);
+	Swap(copy);
 	return *this;
 }
 
+/**
+ * Move assignment operator for QTrees.
+ * Frees the current tree and takes over rhs's nodes without copying
+ * them; rhs is left as an empty tree.
+ *
+ * @param rhs The right hand side of the assignment statement.
+ */
+QTree& QTree::operator=(QTree&& rhs) noexcept {
+	QTree moved(std::move(rhs));
+	Swap(moved);
+	return *this;
+}
+
+/**
+ * Exchanges the contents of this tree and other in constant time.
+ */
+void QTree::Swap(QTree& other) {
+	std::swap(root, other.root);
+	std::swap(height, other.height);
+	std::swap(width, other.width);
+	std::swap(orientation, other.orientation);
+	tiers.swap(other.tiers);
+	pool.swap(other.pool);
+	std::swap(nodeCount, other.nodeCount);
+	std::swap(leafCount, other.leafCount);
+	std::swap(exactAverages, other.exactAverages);
+	std::swap(stats, other.stats);
+}
+
 /**
  * Render returns a PNG image consisting of the pixels
  * stored in the tree. may be used on pruned trees. Draws
@@ -67,40 +335,477 @@ QTree& QTree::operator=(const QTree& rhs) {
  * @pre scale > 0
  */
 PNG QTree::Render(unsigned int scale) const {
+	QTREE_STAT(StatsPhase<Node> phase(stats.renderSeconds, stats, pool));
 	PNG img(width * scale, height * scale);
 	RenderPixel(img, root, scale);
+	QTREE_STAT(stats.leavesRendered += leafCount);
 	return img;
 }
 
-void QTree::RenderPixel(PNG &img, Node* node, unsigned int scale) const {
-	if (node == nullptr) {
-		return;
+RenderOptions::RenderOptions() {
+	threads = 0;
+}
+
+/**
+ * Renders the same image as Render(scale) using up to options.threads
+ * threads. The output is cut into horizontal bands of whole rendered
+ * rows, one per thread; each thread paints only the leaves meeting its
+ * band, clipped to it, so the bands are written without locking.
+ *
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @param options number of threads to use
+ * @pre scale > 0
+ */
+PNG QTree::Render(unsigned int scale, const RenderOptions& options) const {
+	QTREE_STAT(StatsPhase<Node> phase(stats.renderSeconds, stats, pool));
+	PNG img(width * scale, height * scale);
+	if (root == nullptr) {
+		return img;
 	}
 
-	int x = node->lowRight.first - node->upLeft.first + 1;
-	int y = node->lowRight.second - node->upLeft.second + 1;
+	unsigned int threads = options.threads;
+	if (threads == 0) {
+		threads = std::thread::hardware_concurrency();
+	}
+	threads = max(1u, min(threads, height));
 
+	vector<std::thread> workers;
+	vector<uint64_t> painted(threads, 0);
+	for (unsigned int t = 1; t < threads; t++) {
+		unsigned int top = (unsigned long) height * t / threads;
+		unsigned int bottom = (unsigned long) height * (t + 1) / threads - 1;
+		uint64_t& count = painted[t];
+		workers.push_back(std::thread([&img, this, top, bottom, scale, &count]() {
+			RenderBand(img, top, bottom, scale, count);
+		}));
+	}
+	RenderBand(img, 0, height / threads - 1, scale, painted[0]);
+	for (unsigned int t = 0; t < workers.size(); t++) {
+		workers[t].join();
+	}
+	QTREE_STAT(for (uint64_t count : painted) stats.leavesRendered += count);
+	return img;
+}
+
+/**
+ * Private helper for the banded Render: paints rendered rows top..bottom.
+ * When scaling up, a chunk of rows is first painted at scale 1; each of
+ * its rows is then widened into the first of its scaled rows, which is
+ * copied with memcpy into the remaining scale - 1 rows. The number of
+ * leaves painted is added to painted when stats are kept.
+ */
+void QTree::RenderBand(PNG &img, unsigned int top, unsigned int bottom, unsigned int scale, uint64_t& painted) const {
 	if (scale == 1) {
-		for (int i = node->upLeft.first; i<node->upLeft.first + x; i++) {
-			for (int j = node->upLeft.second; j<node->upLeft.second + y; j++) {
-				RGBAPixel* pixel = img.getPixel(i, j);
-				*pixel = node->avg;
+		if (top == 0 && bottom == height - 1) {
+			RenderPixel(img, root, 1);
+			QTREE_STAT(painted += leafCount);
+		} else {
+			PaintRegion(img, make_pair(0, top), make_pair(width - 1, bottom), make_pair(0, 0), 1, painted);
+		}
+		return;
+	}
+
+	const unsigned int CHUNK = 64;
+	PNG rows(width, min(CHUNK, bottom - top + 1));
+	size_t rowBytes = (size_t) width * scale * sizeof(RGBAPixel);
+	for (unsigned int y0 = top; y0 <= bottom; y0 += CHUNK) {
+		unsigned int y1 = min(bottom, y0 + CHUNK - 1);
+		PaintRegion(rows, make_pair(0, y0), make_pair(width - 1, y1), make_pair(0, y0), 1, painted);
+
+		for (unsigned int y = y0; y <= y1; y++) {
+			const RGBAPixel* src = rows.getRow(y - y0);
+			RGBAPixel* first = img.getRow(y * scale);
+			for (unsigned int x = 0; x < width; x++) {
+				std::fill_n(first + x * scale, scale, src[x]);
+			}
+			for (unsigned int k = 1; k < scale; k++) {
+				memcpy(img.getRow(y * scale + k), first, rowBytes);
 			}
 		}
+	}
+}
 
-	} else {
-		for (unsigned int i = 0; i < scale; i++) {
-			for (unsigned int j = 0; j < scale; j++) {
-				RGBAPixel* pixel = img.getPixel(node->upLeft.first * scale + i, node->upLeft.second * scale + j);
-				*pixel = node->avg;
+/**
+ * Private helper for Render. Paints only the leaves (including pruned
+ * leaves) of the subtree, so every output pixel is written exactly once.
+ * Each leaf's rectangle is mapped through the tree's pending orientation.
+ * Each leaf's scaled rectangle is filled one row at a time through a
+ * row pointer, since the PNG pixel buffer is row-major.
+ */
+void QTree::RenderPixel(PNG &img, Node* node, unsigned int scale) const {
+	PreOrder(node, [&](Node* nd) {
+		if (nd->NW != nullptr || nd->NE != nullptr || nd->SW != nullptr || nd->SE != nullptr) {
+			return DESCEND;
+		}
+		FillRect(img, nd, scale);
+		return SKIP_CHILDREN;
+	});
+}
+
+/**
+ * Paints the rectangle ul..lr of img, scaled, with color.
+ */
+static void FillScaled(PNG &img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                       const RGBAPixel& color, unsigned int scale) {
+	unsigned int x0 = ul.first * scale;
+	unsigned int y0 = ul.second * scale;
+	unsigned int x = (lr.first - ul.first + 1) * scale;
+	unsigned int y = (lr.second - ul.second + 1) * scale;
+
+	for (unsigned int j = y0; j < y0 + y; j++) {
+		RGBAPixel* row = img.getRow(j) + x0;
+		std::fill(row, row + x, color);
+	}
+}
+
+/**
+ * Paints nd's scaled rectangle, mapped through the tree's pending
+ * orientation, with nd's average color.
+ */
+void QTree::FillRect(PNG &img, const Node* nd, unsigned int scale) const {
+	pair<unsigned int, unsigned int> ul = nd->upLeft;
+	pair<unsigned int, unsigned int> lr = nd->lowRight;
+	orientation.MapRect(ul, lr);
+	FillScaled(img, ul, lr, nd->avg, scale);
+}
+
+/**
+ * Clips the rectangle ul..lr, given in rendered coordinates, to the image
+ * and maps it to the nodes' coordinates, in place. Returns false if the
+ * rectangle misses the image.
+ */
+bool QTree::ClipToCanonical(pair<unsigned int, unsigned int>& ul, pair<unsigned int, unsigned int>& lr) const {
+	if (root == nullptr || ul.first >= width || ul.second >= height) {
+		return false;
+	}
+	lr.first = min(lr.first, width - 1);
+	lr.second = min(lr.second, height - 1);
+
+	pair<unsigned int, unsigned int> a = orientation.Unmap(ul);
+	pair<unsigned int, unsigned int> b = orientation.Unmap(lr);
+	ul = make_pair(min(a.first, b.first), min(a.second, b.second));
+	lr = make_pair(max(a.first, b.first), max(a.second, b.second));
+	return true;
+}
+
+/**
+ * Returns true if the rectangles ul..lr and nd's rectangle overlap.
+ */
+static bool Meets(const Node* nd, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) {
+	return nd->upLeft.first <= lr.first && ul.first <= nd->lowRight.first
+	    && nd->upLeft.second <= lr.second && ul.second <= nd->lowRight.second;
+}
+
+/**
+ * Renders only the window ul..lr of the tree. The window is mapped back
+ * to the nodes' coordinates, and each leaf meeting it is clipped to it,
+ * mapped to rendered coordinates and painted relative to the window.
+ *
+ * @param ul upper left corner of the window
+ * @param lr lower right corner of the window
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @pre scale > 0, ul.first <= lr.first and ul.second <= lr.second
+ */
+PNG QTree::RenderRegion(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int scale) const {
+	QTREE_STAT(StatsPhase<Node> phase(stats.renderSeconds, stats, pool));
+	PNG img((lr.first - ul.first + 1) * scale, (lr.second - ul.second + 1) * scale);
+	uint64_t painted = 0;
+	PaintRegion(img, ul, lr, ul, scale, painted);
+	QTREE_STAT(stats.leavesRendered += painted);
+	return img;
+}
+
+/**
+ * Paints the leaves meeting the window ul..lr (in rendered coordinates)
+ * onto img, clipped to the window, with rendered pixel origin landing on
+ * img's upper left corner. The number of leaves painted is added to
+ * painted when stats are kept.
+ */
+void QTree::PaintRegion(PNG &img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                        pair<unsigned int, unsigned int> origin, unsigned int scale, uint64_t& painted) const {
+	if (!ClipToCanonical(ul, lr)) {
+		return;
+	}
+
+	uint64_t leaves = 0;
+	PreOrder(root, [&](Node* nd) {
+		if (!Meets(nd, ul, lr)) {
+			return SKIP_CHILDREN;
+		}
+		if (nd->NW != nullptr || nd->NE != nullptr || nd->SW != nullptr || nd->SE != nullptr) {
+			return DESCEND;
+		}
+
+		pair<unsigned int, unsigned int> cul = make_pair(max(nd->upLeft.first, ul.first), max(nd->upLeft.second, ul.second));
+		pair<unsigned int, unsigned int> clr = make_pair(min(nd->lowRight.first, lr.first), min(nd->lowRight.second, lr.second));
+		orientation.MapRect(cul, clr);
+		cul = make_pair(cul.first - origin.first, cul.second - origin.second);
+		clr = make_pair(clr.first - origin.first, clr.second - origin.second);
+		FillScaled(img, cul, clr, nd->avg, scale);
+		QTREE_STAT(leaves++);
+		return SKIP_CHILDREN;
+	});
+	painted += leaves;
+}
+
+/**
+ * Returns the color that Render(1) draws at (x, y). Children always keep
+ * their build layout, so the NW child's corner tells which child holds
+ * the pixel.
+ *
+ * @pre x < width and y < height of the image as rendered
+ */
+RGBAPixel QTree::ColorAt(unsigned int x, unsigned int y) const {
+	pair<unsigned int, unsigned int> p = orientation.Unmap(make_pair(x, y));
+	const Node* nd = root;
+	while (nd->NW != nullptr) {
+		bool east = p.first > nd->NW->lowRight.first;
+		bool south = p.second > nd->NW->lowRight.second;
+		nd = south ? (east ? nd->SE : nd->SW) : (east ? nd->NE : nd->NW);
+	}
+	return nd->avg;
+}
+
+/**
+ * Returns the average color of the rectangle ul..lr. Each node meeting
+ * the rectangle contributes its average weighted by the area they share,
+ * once it is a leaf or lies wholly inside the rectangle.
+ *
+ * @param ul upper left corner of the rectangle
+ * @param lr lower right corner of the rectangle
+ * @pre ul.first <= lr.first and ul.second <= lr.second
+ */
+RGBAPixel QTree::RegionAverage(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const {
+	RGBAPixel avg;
+	if (!ClipToCanonical(ul, lr)) {
+		return avg;
+	}
+
+	uint64_t r = 0;
+	uint64_t g = 0;
+	uint64_t b = 0;
+	uint64_t totalArea = 0;
+	PreOrder(root, [&](Node* nd) {
+		if (!Meets(nd, ul, lr)) {
+			return SKIP_CHILDREN;
+		}
+		bool inside = ul.first <= nd->upLeft.first && nd->lowRight.first <= lr.first
+		           && ul.second <= nd->upLeft.second && nd->lowRight.second <= lr.second;
+		bool leaf = nd->NW == nullptr && nd->NE == nullptr && nd->SW == nullptr && nd->SE == nullptr;
+		if (!inside && !leaf) {
+			return DESCEND;
+		}
+
+		uint64_t w = min(nd->lowRight.first, lr.first) - max(nd->upLeft.first, ul.first) + 1;
+		uint64_t h = min(nd->lowRight.second, lr.second) - max(nd->upLeft.second, ul.second) + 1;
+		r += w * h * nd->avg.r;
+		g += w * h * nd->avg.g;
+		b += w * h * nd->avg.b;
+		totalArea += w * h;
+		return SKIP_CHILDREN;
+	});
+
+	avg.r = r / totalArea;
+	avg.g = g / totalArea;
+	avg.b = b / totalArea;
+	return avg;
+}
+
+/**
+ * Updates the tree after the pixels of img in ul..lr changed. Only the
+ * nodes meeting the rectangle are visited: those inside it, and leaves,
+ * have their subtrees rebuilt from img, and the others, which straddle
+ * its border, are descended into and recombine their averages once
+ * their children are done. Shared nodes are detached before they are
+ * changed, so copies of the tree are not affected.
+ *
+ * @param img the changed image, in the layout the tree was built from
+ * @param ul upper left corner of the changed pixels in img
+ * @param lr lower right corner of the changed pixels in img
+ */
+void QTree::Update(const PNG& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) {
+	if (root == nullptr) {
+		return;
+	}
+	assert(img.width() == root->lowRight.first + 1 && img.height() == root->lowRight.second + 1);
+	if (!Meets(root, ul, lr)) {
+		return;
+	}
+	QTREE_STAT(StatsPhase<Node> phase(stats.updateSeconds, stats, pool));
+	tiers.clear();
+
+	// exact means of the rebuilt nodes and of their ancestors take sums over
+	// the whole of their rectangles, so they need a table of the whole image
+	unique_ptr<IntegralImage> sums;
+	if (exactAverages) {
+		sums.reset(new IntegralImage(img));
+	}
+
+	root = Detach(root);
+	Traverse(root,
+		[&](Node* nd) {
+			if (!Meets(nd, ul, lr)) {
+				return SKIP_CHILDREN;
 			}
+			bool inside = ul.first <= nd->upLeft.first && nd->lowRight.first <= lr.first
+			           && ul.second <= nd->upLeft.second && nd->lowRight.second <= lr.second;
+			bool leaf = nd->NW == nullptr && nd->NE == nullptr && nd->SW == nullptr && nd->SE == nullptr;
+			if (inside || leaf) {
+				DeleteChildren(nd);
+				nd->tier = Node::NO_TIER;
+				FillSubtree(img, nd, *pool);
+				if (sums != nullptr) {
+					AssignExactAverages(nd, *sums);
+				}
+				unsigned int nodes = 0;
+				unsigned int leaves = 0;
+				CountSubtree(nd, nodes, leaves);
+				nodeCount += nodes - 1;
+				leafCount += leaves - 1;
+				return SKIP_CHILDREN;
+			}
+
+			Node** children[4] = { &nd->NW, &nd->NE, &nd->SW, &nd->SE };
+			for (int k = 0; k < 4; k++) {
+				if (*children[k] != nullptr && Meets(*children[k], ul, lr)) {
+					*children[k] = Detach(*children[k]);
+				}
+			}
+			return DESCEND;
+		},
+		[&](Node* nd) {
+			if (Meets(nd, ul, lr)) {
+				if (sums != nullptr) {
+					nd->avg = sums->Average(nd->upLeft, nd->lowRight);
+				} else if (nd->SE != nullptr) {
+					assignColor<SPLIT_QUAD>(nd);
+				} else if (nd->SW != nullptr) {
+					assignColor<SPLIT_VERTICAL>(nd);
+				} else if (nd->NE != nullptr) {
+					assignColor<SPLIT_HORIZONTAL>(nd);
+				}
+			}
+		});
+}
+
+/**
+ * Renders a coarse preview of the tree, drawing the nodes at depth
+ * maxDepth as if they were leaves.
+ *
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @param maxDepth deepest level to draw
+ * @pre scale > 0
+ */
+PNG QTree::Render(unsigned int scale, unsigned int maxDepth) const {
+	QTREE_STAT(StatsPhase<Node> phase(stats.renderSeconds, stats, pool));
+	PNG img(width * scale, height * scale);
+	unsigned int depth = 0;
+	Traverse(root,
+		[&](Node* nd) {
+			if (nd->NW == nullptr && nd->NE == nullptr && nd->SW == nullptr && nd->SE == nullptr) {
+				FillRect(img, nd, scale);
+				QTREE_STAT(stats.leavesRendered++);
+				return SKIP_CHILDREN;
+			}
+			if (depth++ == maxDepth) {
+				FillRect(img, nd, scale);
+				QTREE_STAT(stats.leavesRendered++);
+				return SKIP_CHILDREN;
+			}
+			return DESCEND;
+		},
+		[&](Node* nd) {
+			if (nd->NW != nullptr || nd->NE != nullptr || nd->SW != nullptr || nd->SE != nullptr) {
+				depth--;
+			}
+		});
+	return img;
+}
+
+/**
+ * Returns the deepest depth whose rectangles number at most pixels. A
+ * side of n pixels is cut into min(n, 2^d) pieces at depth d, so the
+ * count only grows until both sides are down to single pixels.
+ *
+ * @param pixels number of rectangles the preview may use; at least 1
+ */
+unsigned int QTree::DepthForBudget(unsigned long pixels) const {
+	unsigned int depth = 0;
+	unsigned long side = 1;
+	while (side < width || side < height) {
+		unsigned long next = side * 2;
+		unsigned long count = min<unsigned long>(width, next) * min<unsigned long>(height, next);
+		if (count > pixels) {
+			break;
 		}
+		side = next;
+		depth++;
 	}
+	return depth;
+}
 
-	RenderPixel(img, node->NW, scale);
-	RenderPixel(img, node->NE, scale);
-	RenderPixel(img, node->SW, scale);
-	RenderPixel(img, node->SE, scale);
+/**
+ * Returns the half-open range of output pixels, out of out spread over
+ * size source pixels, whose footprint centers lie in source pixels
+ * first..last. The center of output pixel o is source pixel
+ * floor((2o + 1) size / 2 out).
+ */
+static pair<unsigned int, unsigned int> CentersWithin(unsigned int first, unsigned int last, unsigned int size, unsigned int out) {
+	auto firstCenteredAtOrAfter = [size, out](uint64_t a) {
+		uint64_t target = 2 * a * out;
+		if (target <= size) {
+			return 0u;
+		}
+		return (unsigned int) min<uint64_t>(out, (target - size + 2 * (uint64_t) size - 1) / (2 * (uint64_t) size));
+	};
+	return make_pair(firstCenteredAtOrAfter(first), firstCenteredAtOrAfter((uint64_t) last + 1));
+}
+
+/**
+ * Renders the tree at outWidth by outHeight. Nodes are mapped to rendered
+ * coordinates and visited from the root; a node holding no output
+ * pixel's center is skipped with its subtree, and a leaf, or a node that
+ * fits within one output pixel's footprint, paints the output pixels
+ * centered in it. Nodes partition the image, so every output pixel is
+ * painted exactly once.
+ *
+ * @param outWidth width of the output
+ * @param outHeight height of the output
+ * @pre 0 < outWidth <= width and 0 < outHeight <= height
+ */
+PNG QTree::RenderDownscaled(unsigned int outWidth, unsigned int outHeight) const {
+	assert(outWidth > 0 && outWidth <= width && outHeight > 0 && outHeight <= height);
+	QTREE_STAT(StatsPhase<Node> phase(stats.renderSeconds, stats, pool));
+	PNG img(outWidth, outHeight);
+	if (root == nullptr) {
+		return img;
+	}
+
+	PreOrder(root, [&](Node* nd) {
+		pair<unsigned int, unsigned int> ul = nd->upLeft;
+		pair<unsigned int, unsigned int> lr = nd->lowRight;
+		orientation.MapRect(ul, lr);
+		pair<unsigned int, unsigned int> xs = CentersWithin(ul.first, lr.first, width, outWidth);
+		pair<unsigned int, unsigned int> ys = CentersWithin(ul.second, lr.second, height, outHeight);
+		if (xs.first >= xs.second || ys.first >= ys.second) {
+			return SKIP_CHILDREN;
+		}
+
+		bool leaf = nd->NW == nullptr && nd->NE == nullptr && nd->SW == nullptr && nd->SE == nullptr;
+		bool fits = (uint64_t) (lr.first - ul.first + 1) * outWidth <= width
+		         && (uint64_t) (lr.second - ul.second + 1) * outHeight <= height;
+		if (!leaf && !fits) {
+			return DESCEND;
+		}
+
+		for (unsigned int y = ys.first; y < ys.second; y++) {
+			RGBAPixel* row = img.getRow(y);
+			std::fill(row + xs.first, row + xs.second, nd->avg);
+		}
+		QTREE_STAT(stats.leavesRendered++);
+		return SKIP_CHILDREN;
+	});
+	return img;
 }
 
 /**
@@ -115,247 +820,624 @@ void QTree::RenderPixel(PNG &img, Node* node, unsigned int scale) const {
  * @pre this tree has not previously been pruned, nor is copied from a previously pruned tree.
  */
 void QTree::Prune(double tolerance) {
-	PruneNode(root, tolerance);
-}
+	QTREE_STAT(StatsPhase<Node> phase(stats.pruneSeconds, stats, pool));
+	vector<Node*> collapse;
+	vector<size_t> marks;
+	vector<ColorBounds> bounds;
 
-void QTree::PruneNode(Node*& subtree, double tolerance) {
+	Traverse(root,
+		[&](Node*) {
+			marks.push_back(collapse.size());
+			return DESCEND;
+		},
+		[&](Node* nd) {
+			PruneNode(nd, tolerance, marks.back(), collapse, bounds);
+			marks.pop_back();
+		});
 
-	if (subtree == nullptr || ((subtree->NW == nullptr) && (subtree->NE == nullptr) && (subtree->SW == nullptr) && (subtree->SE == nullptr))) {
-		return;
+	for (unsigned int i = 0; i < collapse.size(); i++) {
+		Node* nd = Unshare(collapse[i]);
+		DeleteChildren(nd);
 	}
+}
 
-	if (shouldPrune(subtree, subtree->avg, tolerance)) {
-		DeleteChildren(subtree);
-	}
+/**
+ * Annotates every node with the first of the given tolerances at which
+ * Prune would make it a pruned leaf, in one post-order pass.
+ * The tier of an internal node is the index of the smallest tolerance
+ * that is at least the greatest distance from its average to one of its
+ * leaves. That distance is bracketed by the leaves attaining the color
+ * bounds below and by the bounds' corners above; the leaves are only
+ * scanned when the bracket straddles a tolerance.
+ *
+ * @param tolerances pruning tolerances in increasing order
+ * @pre tolerances has fewer than Node::NO_TIER entries
+ */
+void QTree::AnnotateTiers(const vector<double>& tolerances) {
+	QTREE_STAT(StatsPhase<Node> phase(stats.pruneSeconds, stats, pool));
+	assert(std::is_sorted(tolerances.begin(), tolerances.end()));
+	assert(tolerances.size() < Node::NO_TIER);
+	tiers = tolerances;
+	UnshareAll();
 
-	PruneNode(subtree->NW, tolerance);
-	PruneNode(subtree->NE, tolerance);
-	PruneNode(subtree->SW, tolerance);
-	PruneNode(subtree->SE, tolerance);
+	vector<ColorBounds> bounds;
+	Traverse(root,
+		[](Node*) {
+			return DESCEND;
+		},
+		[&](Node* nd) {
+			const ColorBounds& merged = MergeBounds(nd, bounds);
+			if ((nd->NW == nullptr) && (nd->NE == nullptr) && (nd->SW == nullptr) && (nd->SE == nullptr)) {
+				nd->tier = Node::NO_TIER;
+			} else {
+				nd->tier = TierOf(nd, merged);
+			}
+		});
 }
 
-bool QTree::shouldPrune(Node* subtree, RGBAPixel a, double tolerance) {
-	if (subtree == nullptr) {
-		return true;
+/**
+ * Private helper for AnnotateTiers: the tier of an internal node whose
+ * leaves lie within bounds.
+ */
+unsigned char QTree::TierOf(Node* subtree, const ColorBounds& bounds) {
+	QTREE_STAT(stats.pruneTests++);
+	RGBAPixel a = subtree->avg;
+	RGBAPixel witnesses[8];
+	for (int i = 0; i < 4; i++) {
+		witnesses[2 * i] = bounds.minColor[i];
+		witnesses[2 * i + 1] = bounds.maxColor[i];
 	}
-	if ((subtree->NW == nullptr) && (subtree->NE == nullptr) && (subtree->SW == nullptr) && (subtree->SE == nullptr)) {  //leaf node
-		return (subtree->avg.distanceTo(a) <= tolerance);
+	double distances[8];
+	distancesTo(a, witnesses, 8, distances);
+	double lower = *std::max_element(distances, distances + 8);
+
+	size_t lo = std::lower_bound(tiers.begin(), tiers.end(), lower) - tiers.begin();
+	if (lo == tiers.size()) {
+		return Node::NO_TIER;
 	}
-	return shouldPrune(subtree->NW, a, tolerance) && shouldPrune(subtree->NE, a, tolerance) && shouldPrune(subtree->SW, a, tolerance) && shouldPrune(subtree->SE, a, tolerance); 
+	size_t hi = std::lower_bound(tiers.begin(), tiers.end(), CornerBound(a, bounds)) - tiers.begin();
+	if (hi <= lo) {
+		return lo;
+	}
+
+	QTREE_STAT(stats.leafScans++);
+	double farthest = MaxLeafDistance(subtree, a);
+	size_t tier = std::lower_bound(tiers.begin(), tiers.end(), farthest) - tiers.begin();
+	return tier == tiers.size() ? Node::NO_TIER : tier;
 }
 
-void QTree::DeleteChildren(Node*& subtree) {
-	if (subtree == nullptr || ((subtree->NW == nullptr) && (subtree->NE == nullptr) && (subtree->SW == nullptr) && (subtree->SE == nullptr))) {
-		return;
+/**
+ * Returns the greatest distance from a to one of the subtree's leaves.
+ */
+double QTree::MaxLeafDistance(Node* subtree, RGBAPixel a) {
+	const size_t BATCH = 64;
+	RGBAPixel batch[BATCH];
+	double distances[BATCH];
+	size_t count = 0;
+	double farthest = 0;
+
+	PreOrder(subtree, [&](Node* nd) {
+		if ((nd->NW == nullptr) && (nd->NE == nullptr) && (nd->SW == nullptr) && (nd->SE == nullptr)) {  //leaf node
+			batch[count++] = nd->avg;
+			if (count == BATCH) {
+				distancesTo(a, batch, count, distances);
+				farthest = max(farthest, *std::max_element(distances, distances + count));
+				count = 0;
+			}
+			return SKIP_CHILDREN;
+		}
+		return DESCEND;
+	});
+	if (count > 0) {
+		distancesTo(a, batch, count, distances);
+		farthest = max(farthest, *std::max_element(distances, distances + count));
 	}
+	return farthest;
+}
 
-	DeleteChildren(subtree->NW);
-	DeleteChildren(subtree->NE);
-	DeleteChildren(subtree->SW);
-	DeleteChildren(subtree->SE);
+/**
+ * Number of tolerances the tree was annotated with by AnnotateTiers.
+ */
+unsigned int QTree::CountTiers() const {
+	return tiers.size();
+}
 
-	if (subtree->NW != nullptr) {
-		delete subtree->NW;
-		subtree->NW = NULL;
-	}
-	if (subtree->NE != nullptr) {
-		delete subtree->NE;
-		subtree->NE = NULL;
-	}
-	if (subtree->SW != nullptr) {
-		delete subtree->SW;
-		subtree->SW = NULL;
-	}
-	if (subtree->SE != nullptr) {
-		delete subtree->SE;
-		subtree->SE = NULL;
-	}
+/**
+ * Renders the tree as Prune(tolerances[tier]) would leave it, without
+ * changing it: descent stops at the first node whose tier is at most
+ * tier.
+ *
+ * @param tier index into the tolerances given to AnnotateTiers
+ * @param scale multiplier for each horizontal/vertical dimension
+ * @pre tier < CountTiers(), scale > 0
+ */
+PNG QTree::RenderTier(unsigned int tier, unsigned int scale) const {
+	QTREE_STAT(StatsPhase<Node> phase(stats.renderSeconds, stats, pool));
+	PNG img(width * scale, height * scale);
+	PreOrder(root, [&](Node* nd) {
+		bool leaf = (nd->NW == nullptr) && (nd->NE == nullptr) && (nd->SW == nullptr) && (nd->SE == nullptr);
+		if (leaf || nd->tier <= tier) {
+			FillRect(img, nd, scale);
+			QTREE_STAT(stats.leavesRendered++);
+			return SKIP_CHILDREN;
+		}
+		return DESCEND;
+	});
+	return img;
 }
 
 /**
- *  FlipHorizontal rearranges the contents of the tree, so that
- *  its rendered image will appear mirrored across a vertical axis.
- *  This may be called on a previously pruned/flipped/rotated tree.
+ * Prunes the tree exactly as Prune(tolerances[tier]) would, by cutting
+ * below the highest nodes whose tier is at most tier. The remaining
+ * nodes keep their tiers, so the tree can later be pruned to any
+ * higher tier, or rendered at one, in the same way.
  *
- *  After flipping, the NW/NE/SW/SE pointers must map to what will be
- *  physically rendered in the respective NW/NE/SW/SE corners, but it
- *  is no longer necessary to ensure that 1-pixel wide rectangles have
- *  null eastern children
+ * @param tier index into the tolerances given to AnnotateTiers
+ * @pre tier < CountTiers()
  */
-void QTree::FlipHorizontal() {
-	FlipNode(root);
+void QTree::PruneToTier(unsigned int tier) {
+	QTREE_STAT(StatsPhase<Node> phase(stats.pruneSeconds, stats, pool));
+	vector<Node*> collapse;
+	PreOrder(root, [&](Node* nd) {
+		if (nd->NW == nullptr && nd->NE == nullptr && nd->SW == nullptr && nd->SE == nullptr) {
+			return SKIP_CHILDREN;
+		}
+		if (nd->tier <= tier) {
+			collapse.push_back(nd);
+			return SKIP_CHILDREN;
+		}
+		return DESCEND;
+	});
+
+	for (unsigned int i = 0; i < collapse.size(); i++) {
+		Node* nd = Unshare(collapse[i]);
+		DeleteChildren(nd);
+	}
 }
 
-void QTree::FlipNode(Node*& subtree) {
-	if (subtree == nullptr || ((subtree->NW == nullptr) && (subtree->NE == nullptr) && (subtree->SW == nullptr) && (subtree->SE == nullptr))) {
+/**
+ * Private helper for Prune, run on each node on the way back up one
+ * post-order pass over the unmodified tree, once the node's children are
+ * done. Replaces the color bounds of the node's children on top of the
+ * bounds stack with the bounds of the node's leaves, and decides whether
+ * the node meets the prune criterion. Nodes that do are queued in
+ * collapse; entries queued below such a node since mark was taken are
+ * dropped, since the node is collapsed as a whole. Only the highest such
+ * nodes remain queued once the pass is done.
+ * Nothing is deleted until the pass is done, so exact leaf scans made by
+ * CanPrune always see the original leaves.
+ */
+void QTree::PruneNode(Node* subtree, double tolerance, size_t mark, vector<Node*>& collapse, vector<ColorBounds>& bounds) {
+	const ColorBounds& merged = MergeBounds(subtree, bounds);
+	if ((subtree->NW == nullptr) && (subtree->NE == nullptr) && (subtree->SW == nullptr) && (subtree->SE == nullptr)) {
 		return;
 	}
-	int width1, height1;
 
-	if (subtree->NW == nullptr && subtree->SW == nullptr) {
-		width1 = subtree->lowRight.first - subtree->upLeft.first + 1 - (subtree->NE->lowRight.first - subtree->NE->upLeft.first + 1); //total width - NE width
-		height1 = subtree->NE->lowRight.second - subtree->NE->upLeft.second + 1; //NE height
-	} else if (subtree->NW == nullptr && subtree->NE == nullptr) {
-		width1 = subtree->SW->lowRight.first - subtree->SW->upLeft.first + 1; //sw width
-		height1 = subtree->lowRight.second - subtree->upLeft.second + 1 - (subtree->SW->lowRight.second - subtree->SW->upLeft.second + 1); //total height - SW height
-	} else {
-		width1 = subtree->NW->lowRight.first - subtree->NW->upLeft.first + 1; //nw width
-		height1 = subtree->NW->lowRight.second - subtree->NW->upLeft.second + 1; //nw height
+	if (CanPrune(subtree, merged, tolerance)) {
+		collapse.resize(mark);
+		collapse.push_back(subtree);
 	}
+}
 
-	std::swap(subtree->NW, subtree->NE);
-	std::swap(subtree->SW, subtree->SE);
+/**
+ * Replaces the color bounds of subtree's children, on top of the bounds
+ * stack, with the bounds of subtree's leaves, and returns them. A leaf
+ * pushes bounds holding just its own color.
+ */
+const QTree::ColorBounds& QTree::MergeBounds(Node* subtree, vector<ColorBounds>& bounds) {
+	if ((subtree->NW == nullptr) && (subtree->NE == nullptr) && (subtree->SW == nullptr) && (subtree->SE == nullptr)) {
+		bounds.push_back(LeafBounds(subtree->avg));
+		return bounds.back();
+	}
 
-	positionNormal(subtree, width1, height1);
+	size_t count = (subtree->NW != nullptr) + (subtree->NE != nullptr) + (subtree->SW != nullptr) + (subtree->SE != nullptr);
+	size_t first = bounds.size() - count;
+	ColorBounds merged = bounds[first];
+	for (size_t k = first + 1; k < bounds.size(); k++) {
+		Widen(merged, bounds[k]);
+	}
+	bounds.resize(first);
+	bounds.push_back(merged);
+	return bounds.back();
+}
 
-	FlipNode(subtree->NW);
-	FlipNode(subtree->NE);
-	FlipNode(subtree->SW);
-	FlipNode(subtree->SE);
+/**
+ * Returns the bounds of a single leaf of color c.
+ */
+QTree::ColorBounds QTree::LeafBounds(RGBAPixel c) {
+	ColorBounds leaf;
+	double alpha = c.alpha();
+	double p[4] = { (c.r / 255.0) * alpha, (c.g / 255.0) * alpha, (c.b / 255.0) * alpha, alpha };
+	for (int i = 0; i < 4; i++) {
+		leaf.lo[i] = p[i];
+		leaf.hi[i] = p[i];
+		leaf.minColor[i] = c;
+		leaf.maxColor[i] = c;
+	}
+	return leaf;
 }
 
-void QTree::positionNormal(Node*& subtree, int width1, int height1) {
-	if (subtree->NE != nullptr) {
-		subtree->NE->upLeft = make_pair(subtree->lowRight.first - width1 + 1, subtree->upLeft.second);
-		subtree->NE->lowRight = make_pair(subtree->lowRight.first,  subtree->upLeft.second + height1 - 1);
+/**
+ * Widens bounds to take in other, keeping the first color found to
+ * attain each bound.
+ */
+void QTree::Widen(ColorBounds& bounds, const ColorBounds& other) {
+	for (int i = 0; i < 4; i++) {
+		if (other.lo[i] < bounds.lo[i]) {
+			bounds.lo[i] = other.lo[i];
+			bounds.minColor[i] = other.minColor[i];
+		}
+		if (other.hi[i] > bounds.hi[i]) {
+			bounds.hi[i] = other.hi[i];
+			bounds.maxColor[i] = other.maxColor[i];
+		}
 	}
-	if (subtree->NW != nullptr) {
-		subtree->NW->upLeft = make_pair(subtree->upLeft.first, subtree->upLeft.second);
-		subtree->NW->lowRight = make_pair(subtree->lowRight.first - width1, subtree->upLeft.second + height1 - 1);
+}
+
+/**
+ * Answers the prune criterion for an internal node from the bounds of
+ * its leaves, mostly in constant time:
+ *  - The distance is a convex function of the leaf's premultiplied color
+ *    and alpha, so its maximum over the bounding box is reached at one of
+ *    the box's corners. If no corner is farther than tolerance from the
+ *    node's average, no leaf is either.
+ *  - If one of the leaves attaining the bounds is farther than tolerance,
+ *    the criterion fails.
+ * Only when neither test settles it are the leaves scanned, or, if img
+ * is given, the pixels of the node's rectangle in img.
+ */
+bool QTree::CanPrune(Node* subtree, const ColorBounds& bounds, double tolerance, const PNG* img) {
+	QTREE_STAT(stats.pruneTests++);
+	RGBAPixel a = subtree->avg;
+	if (CornerBound(a, bounds) <= tolerance) {
+		return true;
 	}
-	if (subtree->SE != nullptr) {
-		subtree->SE->upLeft = make_pair(subtree->lowRight.first - width1 + 1, subtree->upLeft.second + height1);
-		subtree->SE->lowRight = make_pair(subtree->lowRight.first, subtree->lowRight.second);
+
+	RGBAPixel witnesses[8];
+	for (int i = 0; i < 4; i++) {
+		witnesses[2 * i] = bounds.minColor[i];
+		witnesses[2 * i + 1] = bounds.maxColor[i];
 	}
-	if (subtree->SW != nullptr) {
-		subtree->SW->upLeft = make_pair(subtree->upLeft.first, subtree->upLeft.second + height1);
-		subtree->SW->lowRight = make_pair(subtree->lowRight.first - width1, subtree->lowRight.second);
+	if (!allWithinDistance(a, witnesses, 8, tolerance)) {
+		return false;
 	}
+
+	QTREE_STAT(stats.leafScans++);
+	if (img != nullptr) {
+		return RectWithinTolerance(*img, subtree, a, tolerance);
+	}
+	return shouldPrune(subtree, a, tolerance);
 }
 
+/**
+ * Returns an upper bound on the distance from a to any color inside
+ * bounds: the largest distance to one of the box's corners (one corner
+ * per extreme alpha, the color channels being independent).
+ * Each operation is monotone in the leaf's color, so with a single alpha
+ * the corner bound is exact in floating point; over a range of alphas it
+ * relies on convexity, so room is left for rounding.
+ */
+double QTree::CornerBound(RGBAPixel a, const ColorBounds& bounds) {
+	double refAlpha = a.alpha();
+	double ref[3] = { (a.r / 255.0) * refAlpha, (a.g / 255.0) * refAlpha, (a.b / 255.0) * refAlpha };
+
+	double farthest = 0;
+	for (int j = 0; j < 2; j++) {
+		double alpha = (j == 0) ? bounds.lo[3] : bounds.hi[3];
+		double alphadiff = refAlpha - alpha;
+		double sum = 0;
+		for (int i = 0; i < 3; i++) {
+			double lo = ref[i] - bounds.hi[i];
+			double hi = ref[i] - bounds.lo[i];
+			double maxdiff = max(max(lo * lo, (lo - alphadiff) * (lo - alphadiff)),
+			                     max(hi * hi, (hi - alphadiff) * (hi - alphadiff)));
+			sum += maxdiff;
+		}
+		farthest = max(farthest, sum);
+	}
+
+	double slack = (bounds.lo[3] == bounds.hi[3]) ? 0 : 1e-9;
+	return farthest + slack;
+}
 
 /**
- *  RotateCCW rearranges the contents of the tree, so that its
- *  rendered image will appear rotated by 90 degrees counter-clockwise.
- *  This may be called on a previously pruned/flipped/rotated tree.
- *
- *  After rotation, the NW/NE/SW/SE pointers must map to what will be
- *  physically rendered in the respective NW/NE/SW/SE corners, but it
- *  is no longer necessary to ensure that 1-pixel tall or wide rectangles
- *  have null eastern or southern children
- *  (i.e. after rotation, a node's NW and NE pointers may be null, but have
- *  non-null SW and SE, or it may have null NW/SW but non-null NE/SE)
+ * Returns true if every leaf of the subtree is within tolerance of a.
+ * Leaf colors are gathered into a small buffer and tested a batch at a
+ * time.
  */
-void QTree::RotateCCW() {
-	std::swap(height, width);
-	std::swap(root->lowRight.first, root->lowRight.second);
-	RotateSubtree(root);
-	
+bool QTree::shouldPrune(Node* subtree, RGBAPixel a, double tolerance) {
+	const size_t BATCH = 64;
+	RGBAPixel batch[BATCH];
+	size_t count = 0;
+
+	bool within = PreOrder(subtree, [&](Node* nd) {
+		if ((nd->NW == nullptr) && (nd->NE == nullptr) && (nd->SW == nullptr) && (nd->SE == nullptr)) {  //leaf node
+			batch[count++] = nd->avg;
+			if (count == BATCH) {
+				count = 0;
+				return allWithinDistance(a, batch, BATCH, tolerance) ? SKIP_CHILDREN : STOP;
+			}
+			return SKIP_CHILDREN;
+		}
+		return DESCEND;
+	});
+	return within && allWithinDistance(a, batch, count, tolerance);
 }
 
-void QTree::RotateSubtree(Node*& subtree) {
-	if (subtree == nullptr || ((subtree->NW == nullptr) && (subtree->NE == nullptr) && (subtree->SW == nullptr) && (subtree->SE == nullptr))) {
+/**
+ * Returns the nodes below subtree to the pool's free-list, taking them
+ * off the tree's node and leaf counts.
+ */
+void QTree::DeleteChildren(Node*& subtree) {
+	if (subtree == nullptr) {
 		return;
 	}
 
-	int width1, width2, height1;
-
-	if (subtree->NW == nullptr && subtree->SW == nullptr) {
-		width1 = subtree->lowRight.second - subtree->upLeft.second + 1 - (subtree->NE->lowRight.first - subtree->NE->upLeft.first + 1); //total width - NE width
-		height1 = subtree->NE->lowRight.second - subtree->NE->upLeft.second + 1; //NE height
-		width2 = subtree->NE->lowRight.first - subtree->NE->upLeft.first + 1; //ne width
-	} else if (subtree->NW == nullptr && subtree->NE == nullptr) {
-		width1 = subtree->SW->lowRight.first - subtree->SW->upLeft.first + 1; //sw width
-		width2 = subtree->SE->lowRight.first - subtree->SE->upLeft.first + 1; //se width
-		height1 = subtree->lowRight.first - subtree->upLeft.first + 1 - (subtree->SW->lowRight.second - subtree->SW->upLeft.second + 1); //total height - SW height
-	} else if (subtree->NE == nullptr && subtree->SE == nullptr) {
-		width2 = subtree->lowRight.second - subtree->upLeft.second + 1 - (subtree->NW->lowRight.first - subtree->NW->upLeft.first + 1); //total width - NW width
-		width1 = subtree->NW->lowRight.first - subtree->NW->upLeft.first + 1; //nw width
-		height1 = subtree->NW->lowRight.second - subtree->NW->upLeft.second + 1; //nw height
-	} else {
-		width1 = subtree->NW->lowRight.first - subtree->NW->upLeft.first + 1; //nw width
-		width2 = subtree->NE->lowRight.first - subtree->NE->upLeft.first + 1; //ne width
-		height1 = subtree->NW->lowRight.second - subtree->NW->upLeft.second + 1; //nw height
+	Node* children[4] = { subtree->NW, subtree->NE, subtree->SW, subtree->SE };
+	for (int k = 0; k < 4; k++) {
+		if (children[k] != nullptr) {
+			unsigned int nodes = 0;
+			unsigned int leaves = 0;
+			CountSubtree(children[k], nodes, leaves);
+			nodeCount -= nodes;
+			leafCount -= leaves;
+		}
+	}
+	if (subtree->NW != nullptr) {
+		leafCount++;
 	}
 
-	coordinateHelper(subtree, width1, width2, height1);
-	
-	Node* temp = subtree->SE;
-	subtree->SE = subtree->SW;
-	subtree->SW = subtree->NW;
-	subtree->NW = subtree->NE;
-	subtree->NE = temp;
+	ClearSubtree(subtree->NW);
+	ClearSubtree(subtree->NE);
+	ClearSubtree(subtree->SW);
+	ClearSubtree(subtree->SE);
+}
 
-	RotateSubtree(subtree->NW);
-	RotateSubtree(subtree->NE);
-	RotateSubtree(subtree->SW);
-	RotateSubtree(subtree->SE);
+/**
+ * Adds the number of nodes and of leaves of the subtree to nodes and
+ * leaves, in one pass.
+ */
+void QTree::CountSubtree(Node* subtree, unsigned int& nodes, unsigned int& leaves) const {
+	PreOrder(subtree, [&](Node* nd) {
+		nodes++;
+		if (nd->NW == nullptr && nd->NE == nullptr && nd->SW == nullptr && nd->SE == nullptr) {
+			leaves++;
+		}
+		return DESCEND;
+	});
 }
 
+/**
+ * Returns the depth of the deepest node of the tree; the root is at
+ * depth 0.
+ */
+unsigned int QTree::MaxDepth() const {
+	unsigned int depth = 0;
+	unsigned int deepest = 0;
+	Traverse(root,
+		[&](Node*) {
+			deepest = max(deepest, depth++);
+			return DESCEND;
+		},
+		[&](Node*) {
+			depth--;
+		});
+	return deepest;
+}
 
-void QTree::coordinateHelper(Node*& subtree, int width1, int width2, int height1) {
-	if (subtree->NW != nullptr) {
-		subtree->NW->upLeft = make_pair(subtree->upLeft.first, subtree->upLeft.second + width2);
-		subtree->NW->lowRight = make_pair(subtree->upLeft.first + height1 - 1, subtree->lowRight.second);
-	}
-	if (subtree->NE != nullptr) {
-		subtree->NE->upLeft = make_pair(subtree->upLeft.first, subtree->upLeft.second);
-		subtree->NE->lowRight = make_pair(subtree->upLeft.first + height1 - 1, subtree->upLeft.second + width2 - 1);
-	}
-	if (subtree->SW != nullptr) {
-		subtree->SW->upLeft = make_pair(subtree->upLeft.first + height1, subtree->upLeft.second + width2);
-		subtree->SW->lowRight = make_pair(subtree->lowRight.first, subtree->lowRight.second);
-	}
-	if (subtree->SE != nullptr) {
-		subtree->SE->upLeft = make_pair(subtree->upLeft.first + height1, subtree->upLeft.second);
-		subtree->SE->lowRight = make_pair(subtree->lowRight.first, subtree->upLeft.second + width2 - 1);
-	}
+/**
+ * Number of nodes in the tree, kept up to date by every operation that
+ * adds or removes nodes.
+ */
+unsigned int QTree::NodeCount() const {
+	return nodeCount;
+}
+
+/**
+ * Number of leaves in the tree, kept up to date along with the node count.
+ */
+unsigned int QTree::LeafCount() const {
+	return leafCount;
 }
 
+/**
+ * Counters and timings kept when compiled with QTREE_STATS. The depth is
+ * measured here, with a walk of the tree, rather than after every
+ * operation that could change it.
+ */
+const QTreeStats& QTree::Stats() const {
+	QTREE_STAT(stats.maxDepth = MaxDepth());
+	return stats;
+}
+
+/**
+ * Sets the counters and timings of Stats() back to zero.
+ */
+void QTree::ResetStats() {
+	stats = QTreeStats();
+}
+
+/**
+ *  FlipHorizontal changes the tree so that its rendered image will
+ *  appear mirrored across a vertical axis, by composing a flip onto the
+ *  tree's pending orientation.
+ */
+void QTree::FlipHorizontal() {
+	orientation.FlipHorizontal();
+}
+
+/**
+ *  RotateCCW changes the tree so that its rendered image will
+ *  appear rotated by 90 degrees counter-clockwise, by composing the
+ *  rotation onto the tree's pending orientation.
+ */
+void QTree::RotateCCW() {
+	orientation.RotateCCW();
+	std::swap(height, width);
+}
 
 /**
  * Destroys all dynamically allocated memory associated with the
- * current QTree object.
+ * current QTree object. All nodes live in the tree's pool, so unless
+ * the pool is shared with copies of the tree this frees a handful of
+ * blocks instead of visiting every node. Otherwise only the nodes no
+ * other tree shares are released, and the tree lets go of the pool.
  */
 void QTree:: Clear() {
-	ClearSubtree(root);
+	if (pool.use_count() > 1) {
+		ClearSubtree(root);
+		pool.reset();
+	} else if (pool != nullptr) {
+		pool->Clear();
+	}
+	root = NULL;
+	nodeCount = 0;
+	leafCount = 0;
 }
 
+/**
+ * Drops this tree's reference to a subtree and nulls the subtree
+ * pointer. Nodes no longer shared with any other tree are returned to
+ * the pool's free-list so they can be recycled by later allocations;
+ * below a node that is still shared nothing is visited.
+ */
 void QTree:: ClearSubtree(Node*& subtree) {
-	if (subtree == nullptr) {
-		return;
-	} else {
-		ClearSubtree(subtree->NW);
-		ClearSubtree(subtree->NE);
-		ClearSubtree(subtree->SW);
-		ClearSubtree(subtree->SE);
-		delete subtree;
-		subtree = NULL;
-	}
+	Traverse(subtree,
+		[](Node* nd) {
+			return (--nd->refs == 0) ? DESCEND : SKIP_CHILDREN;
+		},
+		[this](Node* nd) {
+			if (nd->refs == 0) {
+				pool->Release(nd);
+			}
+		});
+	subtree = NULL;
 }
 
 /**
- * Copies the parameter other QTree into the current QTree.
- * Does not free any memory. Called by copy constructor and operator=.
+ * Makes the current QTree a copy of other in constant time, by sharing
+ * other's nodes and pool. Does not free any memory. Called by copy
+ * constructor and operator=.
  * @param other The QTree to be copied.
  */
 void QTree::Copy(const QTree& other) {
 	height = other.height;
 	width = other.width;
-	root = CopyNode(other.root);
+	orientation = other.orientation;
+	tiers = other.tiers;
+	pool = other.pool;
+	root = other.root;
+	nodeCount = other.nodeCount;
+	leafCount = other.leafCount;
+	exactAverages = other.exactAverages;
+	if (root != NULL) {
+		root->refs++;
+	}
 }
 
-Node* QTree::CopyNode(Node* other) {
-	if (other == nullptr) {
-		return NULL;
-	} else {
-		Node* subtree = new Node(other->upLeft, other->lowRight, other->avg);
-		subtree->NW = CopyNode(other->NW);
-		subtree->NE = CopyNode(other->NE);
-		subtree->SW = CopyNode(other->SW);
-		subtree->SE = CopyNode(other->SE);
-		return subtree;
+/**
+ * Returns a node with target's rectangle that only this tree refers to,
+ * so it can be changed without affecting copies of the tree. Every
+ * shared node on the way down from the root, target included, is
+ * replaced by a private copy that shares the original's children.
+ * A node's rectangle identifies it, since children are always smaller
+ * than their parent. If the pool is not shared, no node is, and target
+ * is returned as it is.
+ */
+Node* QTree::Unshare(Node* target) {
+	if (pool.use_count() == 1) {
+		return target;
+	}
+
+	pair<unsigned int, unsigned int> ul = target->upLeft;
+	pair<unsigned int, unsigned int> lr = target->lowRight;
+	Node** slot = &root;
+	while (true) {
+		Node* nd = Detach(*slot);
+		*slot = nd;
+		if (nd->upLeft == ul && nd->lowRight == lr) {
+			return nd;
+		}
+
+		Node** children[4] = { &nd->NW, &nd->NE, &nd->SW, &nd->SE };
+		for (int k = 0; k < 4; k++) {
+			Node* child = *children[k];
+			if (child != nullptr && ul.first >= child->upLeft.first && ul.first <= child->lowRight.first &&
+			    ul.second >= child->upLeft.second && ul.second <= child->lowRight.second) {
+				slot = children[k];
+				break;
+			}
+		}
+	}
+}
+
+/**
+ * Returns nd itself if only one parent (or tree) refers to it. Otherwise
+ * drops that reference to nd and returns a private copy of it, which
+ * shares nd's children; the caller puts the copy in nd's place.
+ */
+Node* QTree::Detach(Node* nd) {
+	if (nd->refs == 1) {
+		return nd;
 	}
+
+	Node* copy = pool->Allocate(nd->upLeft, nd->lowRight, nd->avg);
+	copy->tier = nd->tier;
+	copy->NW = nd->NW;
+	copy->NE = nd->NE;
+	copy->SW = nd->SW;
+	copy->SE = nd->SE;
+	Node* children[4] = { nd->NW, nd->NE, nd->SW, nd->SE };
+	for (int k = 0; k < 4; k++) {
+		if (children[k] != nullptr) {
+			children[k]->refs++;
+		}
+	}
+	nd->refs--;
+	return copy;
+}
+
+/**
+ * Gives the tree private copies of all of its nodes, for changes that
+ * touch every node. Does nothing if the pool is not shared.
+ */
+void QTree::UnshareAll() {
+	if (pool.use_count() == 1 || root == NULL) {
+		return;
+	}
+	Node* copy = CopyNode(root);
+	ClearSubtree(root);
+	root = copy;
+}
+
+/**
+ * Copies the subtree rooted at other. Each copied node starts out
+ * pointing at the original's children; visiting it replaces them with
+ * copies of their own, which are visited next.
+ */
+Node* QTree::CopyNode(Node* other) {
+	auto clone = [this](Node* nd) {
+		if (nd == nullptr) {
+			return (Node*) NULL;
+		}
+		Node* copy = pool->Allocate(nd->upLeft, nd->lowRight, nd->avg);
+		copy->tier = nd->tier;
+		copy->NW = nd->NW;
+		copy->NE = nd->NE;
+		copy->SW = nd->SW;
+		copy->SE = nd->SE;
+		return copy;
+	};
+
+	Node* subtree = clone(other);
+	PreOrder(subtree, [&clone](Node* nd) {
+		nd->NW = clone(nd->NW);
+		nd->NE = clone(nd->NE);
+		nd->SW = clone(nd->SW);
+		nd->SE = clone(nd->SE);
+		return DESCEND;
+	});
+	return subtree;
 }
 
 
@@ -368,76 +1450,184 @@ Node* QTree::CopyNode(Node* other) {
  * @param lr lower right point of current node's rectangle.
  */
 Node* QTree::BuildNode(const PNG& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) {
-	Node* subtree = new Node(ul, lr, RGBAPixel());
-	int x = lr.first - ul.first + 1;
-	int y = lr.second - ul.second + 1;
-
-	double halfw = ceil(x/2.0);
-	double halfh = ceil(y/2.0);
-
-	if (x == 1 && y == 1) {               //if is a leaf node
-		subtree->NW = NULL;
-		subtree->NE = NULL;
-		subtree->SW = NULL;
-		subtree->SE = NULL;
-		subtree->avg = *img.getPixel(ul.first, ul.second);
-	} else if (x == 1 && y != 1) {        //vertical
-		subtree->NW = BuildNode(img, ul, make_pair(ul.first + halfw - 1, ul.second + halfh - 1));
-		subtree->SW = BuildNode(img, make_pair(ul.first, ul.second + halfh), make_pair(ul.first + halfw - 1, lr.second));
-		subtree->NE = NULL;
-		subtree->SE = NULL;
-
-		assignColor(subtree, "v");	
-	} else if (y == 1 && x != 1) {        //horizontal
-		subtree->NW = BuildNode(img, ul, make_pair(ul.first + halfw - 1, ul.second + halfh - 1));
-		subtree->NE = BuildNode(img, make_pair(ul.first + halfw, ul.second), make_pair(lr.first, ul.second + halfh - 1));
-		subtree->SW = NULL;
-		subtree->SE = NULL;
-
-		assignColor(subtree, "h");
-	} else {
-		subtree->NW = BuildNode(img, ul, make_pair(ul.first + halfw - 1, ul.second + halfh - 1));
-		subtree->NE = BuildNode(img, make_pair(ul.first + halfw, ul.second), make_pair(lr.first, ul.second + halfh - 1));
-		subtree->SW = BuildNode(img, make_pair(ul.first, ul.second + halfh), make_pair(ul.first + halfw - 1, lr.second));
-		subtree->SE = BuildNode(img, make_pair(ul.first + halfw, ul.second + halfh), lr);
+	return BuildNode(img, ul, lr, *pool);
+}
 
-		assignColor(subtree, "else");
+/**
+ * Builds the subtree covering ul..lr serially, allocating its nodes from
+ * the given pool.
+ */
+Node* QTree::BuildNode(const PNG& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, Pool<Node>& nodes) {
+	Node* subtree = nodes.Allocate(ul, lr, RGBAPixel());
+	FillSubtree(img, subtree, nodes);
+	return subtree;
+}
+
+/**
+ * Builds the children of subtree, which already has its rectangle, down
+ * to the leaves, and sets every average color. Pixels are read through
+ * img(x, y), so img may be a PNG or anything that can look up the
+ * pixels of subtree's rectangle. Rectangles of two or four pixels get
+ * their leaves made and colored on the spot instead of being visited
+ * one by one.
+ */
+template <class Pixels>
+void QTree::FillSubtree(const Pixels& img, Node* subtree, Pool<Node>& nodes) {
+	FillSubtree(img, subtree, nodes, [](Node*) {});
+}
+
+/**
+ * Same as FillSubtree(img, subtree, nodes), but calls finish(nd) on each
+ * internal node once its subtree is built and its average assigned.
+ * finish may delete the node's children.
+ */
+template <class Pixels, class Finish>
+void QTree::FillSubtree(const Pixels& img, Node* subtree, Pool<Node>& nodes, Finish finish) {
+	Traverse(subtree,
+		[&](Node* nd) {
+			pair<unsigned int, unsigned int> ul = nd->upLeft;
+			pair<unsigned int, unsigned int> lr = nd->lowRight;
+			unsigned int x = lr.first - ul.first + 1;
+			unsigned int y = lr.second - ul.second + 1;
+
+			unsigned int halfw = (x + 1) / 2;
+			unsigned int halfh = (y + 1) / 2;
+
+			if (x == 1 && y == 1) {               //if is a leaf node
+				nd->avg = img(ul.first, ul.second);
+				return SKIP_CHILDREN;
+			} else if (x == 1) {                  //vertical
+				if (y == 2) {
+					nd->NW = nodes.Allocate(ul, ul, img(ul.first, ul.second));
+					nd->SW = nodes.Allocate(lr, lr, img(lr.first, lr.second));
+					return SKIP_CHILDREN;
+				}
+				nd->NW = nodes.Allocate(ul, make_pair(ul.first + halfw - 1, ul.second + halfh - 1), RGBAPixel());
+				nd->SW = nodes.Allocate(make_pair(ul.first, ul.second + halfh), make_pair(ul.first + halfw - 1, lr.second), RGBAPixel());
+			} else if (y == 1) {                  //horizontal
+				if (x == 2) {
+					nd->NW = nodes.Allocate(ul, ul, img(ul.first, ul.second));
+					nd->NE = nodes.Allocate(lr, lr, img(lr.first, lr.second));
+					return SKIP_CHILDREN;
+				}
+				nd->NW = nodes.Allocate(ul, make_pair(ul.first + halfw - 1, ul.second + halfh - 1), RGBAPixel());
+				nd->NE = nodes.Allocate(make_pair(ul.first + halfw, ul.second), make_pair(lr.first, ul.second + halfh - 1), RGBAPixel());
+			} else if (x == 2 && y == 2) {        //2x2 block of leaves
+				pair<unsigned int, unsigned int> ne = make_pair(lr.first, ul.second);
+				pair<unsigned int, unsigned int> sw = make_pair(ul.first, lr.second);
+				nd->NW = nodes.Allocate(ul, ul, img(ul.first, ul.second));
+				nd->NE = nodes.Allocate(ne, ne, img(ne.first, ne.second));
+				nd->SW = nodes.Allocate(sw, sw, img(sw.first, sw.second));
+				nd->SE = nodes.Allocate(lr, lr, img(lr.first, lr.second));
+				return SKIP_CHILDREN;
+			} else {
+				nd->NW = nodes.Allocate(ul, make_pair(ul.first + halfw - 1, ul.second + halfh - 1), RGBAPixel());
+				nd->NE = nodes.Allocate(make_pair(ul.first + halfw, ul.second), make_pair(lr.first, ul.second + halfh - 1), RGBAPixel());
+				nd->SW = nodes.Allocate(make_pair(ul.first, ul.second + halfh), make_pair(ul.first + halfw - 1, lr.second), RGBAPixel());
+				nd->SE = nodes.Allocate(make_pair(ul.first + halfw, ul.second + halfh), lr, RGBAPixel());
+			}
+			return DESCEND;
+		},
+		[&](Node* nd) {
+			if (nd->SE != nullptr) {
+				assignColor<SPLIT_QUAD>(nd);
+			} else if (nd->SW != nullptr) {
+				assignColor<SPLIT_VERTICAL>(nd);
+			} else if (nd->NE != nullptr) {
+				assignColor<SPLIT_HORIZONTAL>(nd);
+			} else {
+				return;
+			}
+			finish(nd);
+		});
+}
+
+/**
+ * Builds the subtree covering ul..lr using up to the given number of
+ * threads, allocating nodes from the given pool. A rectangle's four
+ * quadrants are dealt out to at most four groups; the first group runs on
+ * the calling thread and the others on new threads, each with its own
+ * share of the thread budget and its own pool, which is spliced into
+ * nodes once its thread is done. Rectangles below the cutoff, or with a
+ * budget of one thread, are built serially by BuildNode.
+ */
+Node* QTree::BuildParallel(const PNG& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr,
+                           unsigned int threads, unsigned int cutoff, Pool<Node>& nodes) {
+	unsigned int x = lr.first - ul.first + 1;
+	unsigned int y = lr.second - ul.second + 1;
+
+	if (threads <= 1 || x == 1 || y == 1 || x * y < cutoff) {
+		nodes.Reserve(x * y + x * y / 3 + x + y);
+		return BuildNode(img, ul, lr, nodes);
 	}
 
+	unsigned int halfw = (x + 1) / 2;
+	unsigned int halfh = (y + 1) / 2;
+	pair<unsigned int, unsigned int> cul[4] = {
+		ul,
+		make_pair(ul.first + halfw, ul.second),
+		make_pair(ul.first, ul.second + halfh),
+		make_pair(ul.first + halfw, ul.second + halfh)
+	};
+	pair<unsigned int, unsigned int> clr[4] = {
+		make_pair(ul.first + halfw - 1, ul.second + halfh - 1),
+		make_pair(lr.first, ul.second + halfh - 1),
+		make_pair(ul.first + halfw - 1, lr.second),
+		lr
+	};
+
+	unsigned int groups = threads < 4 ? threads : 4;
+	Node* children[4];
+	Pool<Node> groupPools[3];
+	std::thread workers[3];
+
+	auto work = [&](unsigned int g, Pool<Node>* target) {
+		unsigned int budget = threads / groups + (g < threads % groups ? 1 : 0);
+		for (unsigned int k = g; k < 4; k += groups) {
+			children[k] = BuildParallel(img, cul[k], clr[k], budget, cutoff, *target);
+		}
+	};
+	for (unsigned int g = 1; g < groups; g++) {
+		workers[g - 1] = std::thread(work, g, &groupPools[g - 1]);
+	}
+	work(0, &nodes);
+
+	for (unsigned int g = 1; g < groups; g++) {
+		workers[g - 1].join();
+		nodes.Splice(groupPools[g - 1]);
+	}
+
+	Node* subtree = nodes.Allocate(ul, lr, RGBAPixel());
+	subtree->NW = children[0];
+	subtree->NE = children[1];
+	subtree->SW = children[2];
+	subtree->SE = children[3];
+	assignColor<SPLIT_QUAD>(subtree);
 	return subtree;
 }
 
-void QTree::assignColor(Node*& subtree, string mode) {
-	int nwArea = 0;
-	int neArea = 0;
-	int swArea = 0;
-	int seArea = 0;
-	int totalArea = 0;
-	if (mode == "v") {
-		nwArea = (subtree->NW->lowRight.second - subtree->NW->upLeft.second + 1) * (subtree->NW->lowRight.first - subtree->NW->upLeft.first + 1);
-		swArea = (subtree->SW->lowRight.second - subtree->SW->upLeft.second + 1) * (subtree->SW->lowRight.first - subtree->SW->upLeft.first + 1);
-		totalArea = nwArea + swArea;
-
-		subtree->avg.r = (nwArea * subtree->NW->avg.r + swArea * subtree->SW->avg.r) / totalArea;
-		subtree->avg.g = (nwArea * subtree->NW->avg.g + swArea * subtree->SW->avg.g) / totalArea;
-		subtree->avg.b = (nwArea * subtree->NW->avg.b + swArea * subtree->SW->avg.b) / totalArea;
-	} else if (mode == "h") {
-		nwArea = (subtree->NW->lowRight.second - subtree->NW->upLeft.second + 1) * (subtree->NW->lowRight.first - subtree->NW->upLeft.first + 1);
-		neArea = (subtree->NE->lowRight.second - subtree->NE->upLeft.second + 1) * (subtree->NE->lowRight.first - subtree->NE->upLeft.first + 1);
-		totalArea = nwArea + neArea;
-
-		subtree->avg.r = (nwArea * subtree->NW->avg.r + neArea * subtree->NE->avg.r) / totalArea;
-		subtree->avg.g = (nwArea * subtree->NW->avg.g + neArea * subtree->NE->avg.g) / totalArea;
-		subtree->avg.b = (nwArea * subtree->NW->avg.b + neArea * subtree->NE->avg.b) / totalArea;
+/**
+ * Number of pixels in a node's rectangle.
+ */
+static uint64_t Area(const Node* nd) {
+	return (uint64_t) (nd->lowRight.second - nd->upLeft.second + 1) * (nd->lowRight.first - nd->upLeft.first + 1);
+}
+
+/**
+ * Sets the subtree's average color to the area-weighted average of its
+ * children's averages. The shape is fixed at compile time, so each kind
+ * of split gets its own kernel over exactly the children it has.
+ */
+template <QTree::SplitShape shape>
+void QTree::assignColor(Node* subtree) {
+	if (shape == SPLIT_QUAD) {
+		const RGBAPixel* colors[4] = { &subtree->NW->avg, &subtree->NE->avg, &subtree->SW->avg, &subtree->SE->avg };
+		const uint64_t areas[4] = { Area(subtree->NW), Area(subtree->NE), Area(subtree->SW), Area(subtree->SE) };
+		CombineAverages(subtree->avg, colors, areas);
 	} else {
-		nwArea = (subtree->NW->lowRight.second - subtree->NW->upLeft.second + 1) * (subtree->NW->lowRight.first - subtree->NW->upLeft.first + 1);
-		neArea = (subtree->NE->lowRight.second - subtree->NE->upLeft.second + 1) * (subtree->NE->lowRight.first - subtree->NE->upLeft.first + 1);
-		swArea = (subtree->SW->lowRight.second - subtree->SW->upLeft.second + 1) * (subtree->SW->lowRight.first - subtree->SW->upLeft.first + 1);
-		seArea = (subtree->SE->lowRight.second - subtree->SE->upLeft.second + 1) * (subtree->SE->lowRight.first - subtree->SE->upLeft.first + 1);
-		totalArea = nwArea + neArea + swArea +seArea;
-		
-		subtree->avg.r = (nwArea * subtree->NW->avg.r + neArea * subtree->NE->avg.r + swArea * subtree->SW->avg.r + seArea * subtree->SE->avg.r) / totalArea;
-		subtree->avg.g = (nwArea * subtree->NW->avg.g + neArea * subtree->NE->avg.g + swArea * subtree->SW->avg.g + seArea * subtree->SE->avg.g) / totalArea;
-		subtree->avg.b = (nwArea * subtree->NW->avg.b + neArea * subtree->NE->avg.b + swArea * subtree->SW->avg.b + seArea * subtree->SE->avg.b) / totalArea;
+		Node* second = (shape == SPLIT_VERTICAL) ? subtree->SW : subtree->NE;
+		const RGBAPixel* colors[2] = { &subtree->NW->avg, &second->avg };
+		const uint64_t areas[2] = { Area(subtree->NW), Area(second) };
+		CombineAverages(subtree->avg, colors, areas);
 	}
 }
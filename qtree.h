@@ -1,9 +1,16 @@
 #ifndef _QTREE_H_
 #define _QTREE_H_
 
+#include <memory>
 #include <utility>
+#include <vector>
 #include "cs221util/PNG.h"
 #include "cs221util/RGBAPixel.h"
+#include "integralimage.h"
+#include "orientation.h"
+#include "pool.h"
+#include "rowsource.h"
+#include "stats.h"
 
 using namespace std;
 using namespace cs221util;
@@ -15,10 +22,45 @@ public:
     pair<unsigned int, unsigned int> upLeft;   // image coordinates of upper-left corner of node's rectangular region
     pair<unsigned int, unsigned int> lowRight; // image coordinates of lower-right corner of node's rectangular region
     RGBAPixel avg;  // average color of node's rectangular region
+    unsigned char tier; // first pruning tier at which this node is a pruned leaf (see QTree::AnnotateTiers), or NO_TIER
+    unsigned int refs; // number of parents, or of trees for a root, that share this node (see QTree(const QTree&))
     Node* NW; // upper-left child
     Node* NE; // upper-right child
     Node* SW; // lower-left child
     Node* SE; // lower-right child
+
+    static const unsigned char NO_TIER = 255; // tier of nodes that are not pruned at any tier
+};
+
+
+/**
+ * Options for building a QTree.
+ * The four quadrants of a rectangle are independent until their average
+ * colors are combined, so the top of the tree is split into tasks that
+ * run on separate threads, each building whole subtrees serially.
+ *
+ * By default a node's average is combined from its children's already
+ * rounded averages, as the assignment requires. With exactAverages set,
+ * every node instead gets the exact mean of its rectangle (alpha
+ * included), found in constant time from a summed-area table of the image.
+ */
+struct BuildOptions {
+    BuildOptions();
+
+    unsigned int threads;      // maximum number of threads to use; 0 means one per hardware thread
+    unsigned int serialCutoff; // rectangles with fewer pixels than this are always built serially
+    bool exactAverages;        // derive every average from an integral image instead of from the children
+};
+
+/**
+ * Options for rendering a QTree on several threads.
+ * The output image is cut into horizontal bands, one per thread, that
+ * are painted independently.
+ */
+struct RenderOptions {
+    RenderOptions();
+
+    unsigned int threads; // maximum number of threads to use; 0 means one per hardware thread
 };
 
 
@@ -41,6 +83,12 @@ public:
      * must define the Big Three). This depends on your implementation
      * of the copy funtion.
      *
+     * The copy is made in constant time by sharing other's nodes, which
+     * are reference counted. Either tree copies the path down to a node
+     * before changing it, so nodes that are never changed stay shared.
+     * Trees sharing nodes also share their pool, so they must not be
+     * modified at the same time from different threads.
+     *
      * @param other The QTree  we are copying.
      */
     QTree(const QTree& other);
@@ -57,6 +105,33 @@ public:
 
     /* =============== end of given functions ====================*/
 
+    /**
+     * Number of nodes in the tree, the same as CountNodes(), in constant
+     * time. The count is kept up to date as the tree changes.
+     */
+    unsigned int NodeCount() const;
+
+    /**
+     * Number of leaves in the tree, the same as CountLeaves(), in
+     * constant time.
+     */
+    unsigned int LeafCount() const;
+
+    /**
+     * Counters and timings of the operations made on this object since
+     * it was constructed or ResetStats was called. They are only kept
+     * when the tree is compiled with QTREE_STATS defined, and are all
+     * zero otherwise. maxDepth is measured by this call, in time linear
+     * in the size of the tree. A tree must not be rendered from several
+     * threads at once, nor while Stats is called, when stats are kept.
+     */
+    const QTreeStats& Stats() const;
+
+    /**
+     * Sets every counter and timing of Stats() back to zero.
+     */
+    void ResetStats();
+
     /* =============== public PA3 FUNCTIONS =========================*/
 
     /**
@@ -95,16 +170,70 @@ public:
      */
     QTree(const PNG& imIn);
 
+    /**
+     * Constructor that builds the same QTree as QTree(imIn), using up to
+     * options.threads threads. The result is identical to the serial
+     * build, node for node, unless options.exactAverages is set, in which
+     * case the splits are the same but every node holds the exact average
+     * color of its rectangle.
+     *
+     * @param imIn the image to build the tree from.
+     * @param options how the tree is to be built; see BuildOptions.
+     */
+    QTree(const PNG& imIn, const BuildOptions& options);
+
+    /**
+     * Constructor that builds the same QTree as QTree(imIn) followed by
+     * Prune(tolerance), without ever holding the whole unpruned tree.
+     * Each subtree is tested against the prune criterion as soon as it is
+     * finished and, if it meets it, collapsed on the spot, so the nodes
+     * below it are recycled for the rest of the build.
+     *
+     * @param imIn the image to build the tree from.
+     * @param tolerance the prune tolerance; see Prune.
+     */
+    QTree(const PNG& imIn, double tolerance);
+
+    /**
+     * Constructor that builds the same QTree as QTree(imIn) from an image
+     * read one row at a time, top to bottom, so the whole image never has
+     * to be in memory. Only a single row is buffered while the tree is
+     * built. If the source fails partway, the rows it could not provide
+     * are built as default (opaque black) pixels.
+     *
+     * @param source the rows of the image.
+     */
+    QTree(RowSource& source);
+
+    /**
+     * Move constructor for a QTree.
+     * Takes over other's nodes without copying them; other is left as
+     * an empty tree. Never allocates or throws, so containers of QTrees
+     * move them rather than copy them when they grow.
+     *
+     * @param other The QTree we are moving from.
+     */
+    QTree(QTree&& other) noexcept;
+
     /**
      * Overloaded assignment operator for QTrees.
      * Part of the Big Three that we must define because the class
-     * allocates dynamic memory. This depends on your implementation
-     * of the copy and clear funtions.
+     * allocates dynamic memory. Copies rhs and swaps the copy in, so the
+     * old tree is freed and self-assignment is safe.
      *
      * @param rhs The right hand side of the assignment statement.
      */
     QTree& operator=(const QTree& rhs);
 
+    /**
+     * Move assignment operator for QTrees.
+     * Frees the current tree and takes over rhs's nodes without copying
+     * them; rhs is left as an empty tree.
+     *
+     * @param rhs The right hand side of the assignment statement.
+     */
+    QTree& operator=(QTree&& rhs) noexcept;
+
     /**
      * Render returns a PNG image consisting of the pixels
      * stored in the tree. may be used on pruned trees. Draws
@@ -119,6 +248,112 @@ public:
      */
     PNG Render(unsigned int scale) const;
 
+    /**
+     * Renders a coarse preview of the tree: nodes at depth maxDepth (the
+     * root is at depth 0) are drawn with their average color as if they
+     * were leaves, and nothing below them is visited.
+     * Render(scale, d) for d at least the tree's height equals Render(scale).
+     *
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @param maxDepth deepest level to draw
+     * @pre scale > 0
+     */
+    PNG Render(unsigned int scale, unsigned int maxDepth) const;
+
+    /**
+     * Renders the same image as Render(scale) on up to options.threads
+     * threads, each painting its own band of rows. Scaled rows are
+     * produced by widening one row and copying it, rather than filling
+     * each leaf's rectangle row by row.
+     *
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @param options number of threads to use
+     * @pre scale > 0
+     */
+    PNG Render(unsigned int scale, const RenderOptions& options) const;
+
+    /**
+     * Returns the deepest depth at which the tree is drawn with at most
+     * the given number of distinct rectangles, which is the effective
+     * resolution of Render(scale, depth) in pixels. Rectangles halve on
+     * every level, so this depends only on the image's dimensions.
+     *
+     * @param pixels number of rectangles the preview may use; at least 1
+     */
+    unsigned int DepthForBudget(unsigned long pixels) const;
+
+    /**
+     * Renders the tree shrunk to outWidth by outHeight pixels. Each output
+     * pixel covers a footprint of width / outWidth by height / outHeight
+     * rendered pixels and takes the average color of the node holding the
+     * footprint's center, at the first depth where nodes fit within a
+     * footprint (or of the leaf holding it, if shallower). Only nodes
+     * holding some footprint's center are visited, so the cost depends on
+     * the output size rather than on the size of the tree.
+     *
+     * @param outWidth width of the output
+     * @param outHeight height of the output
+     * @pre 0 < outWidth <= width and 0 < outHeight <= height of the image as rendered
+     */
+    PNG RenderDownscaled(unsigned int outWidth, unsigned int outHeight) const;
+
+    /**
+     * Renders only the window ul..lr (inclusive, in the coordinates of the
+     * image as rendered) of the tree, as a PNG of the window's size times
+     * scale, the same as cropping Render(scale) to the scaled window.
+     * Only nodes whose rectangles meet the window are visited. Parts of
+     * the window outside the image are left as default pixels.
+     *
+     * @param ul upper left corner of the window
+     * @param lr lower right corner of the window
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @pre scale > 0, ul.first <= lr.first and ul.second <= lr.second
+     */
+    PNG RenderRegion(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr, unsigned int scale) const;
+
+    /**
+     * Returns the color that Render(1) draws at (x, y), found by following
+     * the one path from the root to the leaf covering that pixel.
+     *
+     * @pre x < width and y < height of the image as rendered
+     */
+    RGBAPixel ColorAt(unsigned int x, unsigned int y) const;
+
+    /**
+     * Returns the average color of the rectangle ul..lr (inclusive, in the
+     * coordinates of the image as rendered, clipped to the image).
+     * Nodes lying wholly inside the rectangle contribute their stored
+     * average without being descended into, so only the nodes along the
+     * rectangle's border are visited. Red, green and blue are combined
+     * the way a node's children are; alpha is left at its default.
+     *
+     * @param ul upper left corner of the rectangle
+     * @param lr lower right corner of the rectangle
+     * @pre ul.first <= lr.first and ul.second <= lr.second
+     */
+    RGBAPixel RegionAverage(pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr) const;
+
+    /**
+     * Brings the tree up to date with img after the pixels in ul..lr
+     * changed, without rebuilding the rest of it. Subtrees lying inside
+     * the rectangle are rebuilt from img, and the averages of the nodes
+     * on the rectangle's border are recombined on the way back up, so an
+     * unpruned tree ends up identical to QTree(img). On a tree built with
+     * BuildOptions::exactAverages, the nodes Update touches get the exact
+     * means of their rectangles instead, from a summed-area table of img,
+     * so the tree matches QTree(img, options) and the update also costs
+     * one pass over img. A pruned leaf meeting the rectangle is rebuilt
+     * down to pixels. Tiers set by AnnotateTiers are discarded.
+     *
+     * @param img the changed image, in the layout the tree was built
+     *        from (before any flips or rotations)
+     * @param ul upper left corner of the changed pixels in img
+     * @param lr lower right corner of the changed pixels in img
+     * @pre img has the dimensions the tree was built with,
+     *      ul.first <= lr.first and ul.second <= lr.second
+     */
+    void Update(const PNG& img, pair<unsigned int, unsigned int> ul, pair<unsigned int, unsigned int> lr);
+
     /**
      *  Prune function trims subtrees as high as possible in the tree.
      *  A subtree is pruned (cleared) if all of the subtree's leaves are within
@@ -133,33 +368,65 @@ public:
     void Prune(double tolerance);
 
     /**
-     *  FlipHorizontal rearranges the contents of the tree, so that
-     *  its rendered image will appear mirrored across a vertical axis.
+     * Prepares the tree to be pruned or rendered at several tolerances
+     * without copying it: annotates each node, in one pass, with the
+     * index of the first of the given tolerances at which Prune would
+     * make it a pruned leaf. Afterwards RenderTier(k) and PruneToTier(k)
+     * give the results of Prune(tolerances[k]) at the cost of one
+     * comparison per node visited.
+     *
+     * @param tolerances pruning tolerances in increasing order, fewer
+     *        than 255 of them
+     * @pre this tree has not previously been pruned.
+     */
+    void AnnotateTiers(const vector<double>& tolerances);
+
+    /**
+     * Number of tolerances given to the last AnnotateTiers.
+     */
+    unsigned int CountTiers() const;
+
+    /**
+     * Renders the tree as Prune(tolerances[tier]) would leave it, without
+     * modifying the tree.
+     *
+     * @param tier index into the tolerances given to AnnotateTiers
+     * @param scale multiplier for each horizontal/vertical dimension
+     * @pre tier < CountTiers(), scale > 0
+     */
+    PNG RenderTier(unsigned int tier, unsigned int scale) const;
+
+    /**
+     * Prunes the tree exactly as Prune(tolerances[tier]) would. Unlike
+     * Prune, it may be called again with a higher tier afterwards.
+     *
+     * @param tier index into the tolerances given to AnnotateTiers
+     * @pre tier < CountTiers()
+     */
+    void PruneToTier(unsigned int tier);
+
+    /**
+     *  FlipHorizontal changes the tree so that its rendered image will
+     *  appear mirrored across a vertical axis.
      *  This may be called on a previously pruned/flipped/rotated tree.
      *
-     *  After flipping, the NW/NE/SW/SE pointers must map to what will be
-     *  physically rendered in the respective NW/NE/SW/SE corners, but it
-     *  is no longer necessary to ensure that 1-pixel wide rectangles have
-     *  null eastern children
-     *  (i.e. after flipping, a node's NW and SW pointers may be null, but
-     *  have non-null NE and SE)
+     *  The nodes themselves are not touched: the tree records its pending
+     *  orientation (one of the 8 flip/rotate states), which Render applies
+     *  to each leaf's rectangle. Any chain of flips and rotations therefore
+     *  takes constant time.
      */
     void FlipHorizontal();
 
     /**
-     *  RotateCCW rearranges the contents of the tree, so that its
-     *  rendered image will appear rotated by 90 degrees counter-clockwise.
+     *  RotateCCW changes the tree so that its rendered image will
+     *  appear rotated by 90 degrees counter-clockwise.
      *  This may be called on a previously pruned/flipped/rotated tree.
      *
      *  Note that this may alter the dimensions of the rendered image, relative
      *  to its original dimensions.
      *
-     *  After rotation, the NW/NE/SW/SE pointers must map to what will be
-     *  physically rendered in the respective NW/NE/SW/SE corners, but it
-     *  is no longer necessary to ensure that 1-pixel tall or wide rectangles
-     *  have null eastern or southern children
-     *  (i.e. after rotation, a node's NW and NE pointers may be null, but have
-     *  non-null SW and SE, or it may have null NW/SW but non-null NE/SE)
+     *  Like FlipHorizontal, this only updates the tree's pending orientation
+     *  in constant time; the nodes keep the layout they were built with.
      */
     void RotateCCW();
 
@@ -173,8 +440,8 @@ private:
      */
     Node* root; // pointer to the root of the QTree
 
-    unsigned int height; // height of PNG represented by the tree
-    unsigned int width; // width of PNG represented by the tree
+    unsigned int height; // height of PNG represented by the tree, as rendered
+    unsigned int width; // width of PNG represented by the tree, as rendered
 
     /* =================== private PA3 functions ============== */
 
@@ -186,8 +453,9 @@ private:
     void Clear();
 
     /**
-    * Copies the parameter other QTree into the current QTree.
-    * Does not free any memory. Called by copy constructor and operator=.
+    * Copies the parameter other QTree into the current QTree, sharing
+    * its nodes. Does not free any memory. Called by the copy constructor,
+    * which operator= uses to make the copy it swaps in.
     * You may want a recursive helper function for this one.
     * @param other The QTree to be copied.
     */
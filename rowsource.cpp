@@ -0,0 +1,63 @@
+#include "rowsource.h"
+#include <algorithm>
+#include <iostream>
+
+RowSource::~RowSource() {}
+
+PNGRowSource::PNGRowSource(const PNG& img) : img(img), next(0) {}
+
+unsigned int PNGRowSource::Width() const {
+	return img.width();
+}
+
+unsigned int PNGRowSource::Height() const {
+	return img.height();
+}
+
+bool PNGRowSource::ReadRow(RGBAPixel* row) {
+	if (next >= img.height()) {
+		return false;
+	}
+	const RGBAPixel* src = img.getRow(next++);
+	std::copy(src, src + img.width(), row);
+	return true;
+}
+
+RawRowSource::RawRowSource(string const & fileName, unsigned int width, unsigned int height)
+	: width(width), height(height) {
+	file = fopen(fileName.c_str(), "rb");
+	if (file == NULL) {
+		cerr << "RawRowSource: could not open " << fileName << endl;
+	}
+}
+
+RawRowSource::~RawRowSource() {
+	if (file != NULL) {
+		fclose(file);
+	}
+}
+
+unsigned int RawRowSource::Width() const {
+	return width;
+}
+
+unsigned int RawRowSource::Height() const {
+	return height;
+}
+
+/**
+ * Reads the next row straight into row, which already has the file's
+ * RGBA8 layout.
+ */
+bool RawRowSource::ReadRow(RGBAPixel* row) {
+	if (file == NULL) {
+		return false;
+	}
+	if (fread(row, sizeof(RGBAPixel), width, file) != width) {
+		cerr << "RawRowSource: file ended before the last row" << endl;
+		fclose(file);
+		file = NULL;
+		return false;
+	}
+	return true;
+}
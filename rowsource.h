@@ -0,0 +1,86 @@
+#ifndef _ROWSOURCE_H_
+#define _ROWSOURCE_H_
+
+#include <cstdio>
+#include <string>
+#include "cs221util/PNG.h"
+#include "cs221util/RGBAPixel.h"
+
+using namespace std;
+using namespace cs221util;
+
+/**
+ * RowSource hands out the rows of an image one at a time, top to bottom.
+ * It lets a QTree be built from images too large to hold in memory whole:
+ * the tree needs each row only once, in order.
+ */
+class RowSource {
+public:
+    virtual ~RowSource();
+
+    /**
+     * Width of the image, in pixels.
+     */
+    virtual unsigned int Width() const = 0;
+
+    /**
+     * Height of the image, in pixels.
+     */
+    virtual unsigned int Height() const = 0;
+
+    /**
+     * Copies the next row of the image into row[0..Width()).
+     * Returns false if the row could not be read.
+     */
+    virtual bool ReadRow(RGBAPixel* row) = 0;
+};
+
+/**
+ * RowSource over a PNG that is already in memory.
+ */
+class PNGRowSource : public RowSource {
+public:
+    PNGRowSource(const PNG& img);
+
+    unsigned int Width() const;
+    unsigned int Height() const;
+    bool ReadRow(RGBAPixel* row);
+
+private:
+    const PNG& img;
+    unsigned int next; // index of the next row to hand out
+};
+
+/**
+ * RowSource over a file of raw, uncompressed pixels: width * height
+ * pixels in row-major order, 4 bytes each (red, green, blue, alpha).
+ * This is the layout tiling and mosaicking tools dump large images in;
+ * the file is read one row at a time.
+ */
+class RawRowSource : public RowSource {
+public:
+    /**
+     * Opens fileName as a width x height raw RGBA8 image. If the file
+     * cannot be opened, an error is printed and every ReadRow fails.
+     */
+    RawRowSource(string const & fileName, unsigned int width, unsigned int height);
+
+    /**
+     * Closes the file.
+     */
+    ~RawRowSource();
+
+    unsigned int Width() const;
+    unsigned int Height() const;
+    bool ReadRow(RGBAPixel* row);
+
+private:
+    FILE* file;
+    unsigned int width;
+    unsigned int height;
+
+    RawRowSource(const RawRowSource&) = delete;
+    RawRowSource& operator=(const RawRowSource&) = delete;
+};
+
+#endif
@@ -0,0 +1,84 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include "pool.h"
+
+/**
+ * Optional instrumentation of QTree (and of PNG reads and writes).
+ * Statements wrapped in QTREE_STAT are compiled only when QTREE_STATS is
+ * defined, e.g. with -DQTREE_STATS; otherwise they compile to nothing and
+ * every counter stays zero.
+ */
+#ifdef QTREE_STATS
+#define QTREE_STAT(...) __VA_ARGS__
+#else
+#define QTREE_STAT(...)
+#endif
+
+/**
+ * Counters and timings of the operations made on one QTree object.
+ * Only kept when built with QTREE_STATS; see QTree::Stats.
+ */
+struct QTreeStats {
+    QTreeStats()
+        : buildSeconds(0), pruneSeconds(0), renderSeconds(0), updateSeconds(0),
+          nodesAllocated(0), nodesFreed(0), leavesRendered(0), pruneTests(0), leafScans(0), maxDepth(0) {}
+
+    double buildSeconds;     // time spent in constructors
+    double pruneSeconds;     // time spent in Prune, AnnotateTiers and PruneToTier
+    double renderSeconds;    // time spent rendering, in all Render variants, RenderRegion and RenderTier
+    double updateSeconds;    // time spent in Update
+    uint64_t nodesAllocated; // nodes taken from the pool by this tree
+    uint64_t nodesFreed;     // nodes given back to the pool by this tree
+    uint64_t leavesRendered; // leaves painted by renders
+    uint64_t pruneTests;     // internal nodes tested against the prune criterion
+    uint64_t leafScans;      // prune tests that had to scan the node's leaves or pixels
+    unsigned int maxDepth;   // depth of the deepest node, measured by QTree::Stats
+};
+
+#ifdef QTREE_STATS
+/**
+ * Adds the time between its construction and destruction to seconds,
+ * and the nodes allocated from and released to pool in between to
+ * stats. pool may be null, for a tree that has no nodes.
+ */
+template <class T>
+class StatsPhase {
+public:
+    StatsPhase(double& seconds, QTreeStats& stats, const std::shared_ptr<Pool<T>>& pool)
+        : seconds(seconds), stats(stats), pool(pool), start(std::chrono::steady_clock::now()),
+          allocations(Allocations(pool)), size(Size(pool)) {}
+
+    ~StatsPhase() {
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        seconds += elapsed.count();
+        uint64_t allocated = Allocations(pool) - allocations;
+        stats.nodesAllocated += allocated;
+        stats.nodesFreed += allocated - (Size(pool) - size);
+    }
+
+private:
+    double& seconds;
+    QTreeStats& stats;
+    const std::shared_ptr<Pool<T>>& pool;
+    std::chrono::steady_clock::time_point start;
+    uint64_t allocations;
+    uint64_t size;
+
+    static uint64_t Allocations(const std::shared_ptr<Pool<T>>& pool) {
+        return pool != nullptr ? pool->Allocations() : 0;
+    }
+
+    static uint64_t Size(const std::shared_ptr<Pool<T>>& pool) {
+        return pool != nullptr ? pool->Size() : 0;
+    }
+
+    StatsPhase(const StatsPhase&) = delete;
+    StatsPhase& operator=(const StatsPhase&) = delete;
+};
+#endif
+
+#endif
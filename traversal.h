@@ -0,0 +1,147 @@
+#ifndef _TRAVERSAL_H_
+#define _TRAVERSAL_H_
+
+#include <cstddef>
+#include <vector>
+#include "qtree.h"
+
+/**
+ * Iterative traversals over QTree nodes.
+ * Every tree operation walks the tree through PreOrder or Traverse rather
+ * than recursing, so stack usage does not depend on the shape of the tree
+ * and there is one place (Push below) where children are prefetched.
+ */
+
+/**
+ * What a visitor returns after entering a node.
+ */
+enum TraverseStep {
+    DESCEND,       // visit the node's children next
+    SKIP_CHILDREN, // do not visit the node's children
+    STOP           // end the traversal immediately
+};
+
+/**
+ * Explicit traversal stack. Trees built from an image are only about
+ * log2(max(width, height)) levels deep, so the stack nearly always fits in
+ * its inline buffer; it moves to the heap only if it has to grow past it.
+ */
+template <class T>
+class TraverseStack {
+public:
+    TraverseStack() : data(inline_), size(0), capacity(INLINE) {}
+
+    bool Empty() const { return size == 0; }
+
+    void Push(const T& item) {
+        if (size == capacity) {
+            if (heap.empty()) {
+                heap.assign(data, data + size);
+            }
+            heap.resize(2 * capacity);
+            data = &heap[0];
+            capacity = heap.size();
+        }
+        data[size++] = item;
+    }
+
+    T Pop() { return data[--size]; }
+
+private:
+    static const size_t INLINE = 256;
+
+    T inline_[INLINE];
+    std::vector<T> heap;
+    T* data;
+    size_t size;
+    size_t capacity;
+
+    TraverseStack(const TraverseStack&) = delete;
+    TraverseStack& operator=(const TraverseStack&) = delete;
+};
+
+/**
+ * Pushes the non-null children of nd in reverse, so that they are popped
+ * in NW, NE, SW, SE order, and prefetches them.
+ */
+template <class T, class Make>
+inline void PushChildren(TraverseStack<T>& stack, Node* nd, Make make) {
+    Node* children[4] = { nd->SE, nd->SW, nd->NE, nd->NW };
+    for (int k = 0; k < 4; k++) {
+        if (children[k] != nullptr) {
+            __builtin_prefetch(children[k]);
+            stack.Push(make(children[k]));
+        }
+    }
+}
+
+/**
+ * Visits the subtree rooted at root in pre-order (a node before its
+ * children; children in NW, NE, SW, SE order). enter(nd) is called on each
+ * node and returns a TraverseStep. The node's children are read after
+ * enter returns, so enter may create, replace or reorder them.
+ *
+ * @return false if a visitor returned STOP, true otherwise.
+ */
+template <class Enter>
+bool PreOrder(Node* root, Enter enter) {
+    if (root == nullptr) {
+        return true;
+    }
+
+    TraverseStack<Node*> stack;
+    stack.Push(root);
+    while (!stack.Empty()) {
+        Node* nd = stack.Pop();
+        TraverseStep step = enter(nd);
+        if (step == STOP) {
+            return false;
+        }
+        if (step == DESCEND) {
+            PushChildren(stack, nd, [](Node* c) { return c; });
+        }
+    }
+    return true;
+}
+
+/**
+ * Visits the subtree rooted at root, calling enter(nd) on the way down
+ * (as in PreOrder) and leave(nd) on the way back up, once all of the
+ * node's children have been left. leave is called for every node that
+ * was entered, whether or not its children were visited.
+ *
+ * @return false if a visitor returned STOP, true otherwise.
+ */
+template <class Enter, class Leave>
+bool Traverse(Node* root, Enter enter, Leave leave) {
+    if (root == nullptr) {
+        return true;
+    }
+
+    struct Frame {
+        Node* nd;
+        bool entered;
+    };
+
+    TraverseStack<Frame> stack;
+    stack.Push(Frame{ root, false });
+    while (!stack.Empty()) {
+        Frame frame = stack.Pop();
+        if (frame.entered) {
+            leave(frame.nd);
+            continue;
+        }
+
+        TraverseStep step = enter(frame.nd);
+        if (step == STOP) {
+            return false;
+        }
+        stack.Push(Frame{ frame.nd, true });
+        if (step == DESCEND) {
+            PushChildren(stack, frame.nd, [](Node* c) { return Frame{ c, false }; });
+        }
+    }
+    return true;
+}
+
+#endif